@@ -0,0 +1,679 @@
+// For the recovery benchmark. Otherwise costs a null check per message.
+#define WIN_PIPE_ENABLE_FAULT_INJECTION
+
+#include "win-pipe.h"
+
+#include <Psapi.h>
+#include <TlHelp32.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Benchmarks, one per subcommand. Each prints its results and exits.
+
+void run_pipeline();
+void run_recovery();
+void run_scale(int argc, char** argv);
+void run_startup(int argc, char** argv);
+void run_merge(int argc, char** argv);
+void run_ack();
+void run_topics();
+void run_rpc(int argc, char** argv);
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "Specify a benchmark: pipeline, recovery, scale, startup, merge, ack, topics, rpc." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "pipeline") == 0)
+        run_pipeline();
+
+    else if (strcmp(argv[1], "recovery") == 0)
+        run_recovery();
+
+    else if (strcmp(argv[1], "scale") == 0)
+        run_scale(argc, argv);
+
+    else if (strcmp(argv[1], "startup") == 0)
+        run_startup(argc, argv);
+
+    else if (strcmp(argv[1], "merge") == 0)
+        run_merge(argc, argv);
+
+    else if (strcmp(argv[1], "ack") == 0)
+        run_ack();
+
+    else if (strcmp(argv[1], "topics") == 0)
+        run_topics();
+
+    else if (strcmp(argv[1], "rpc") == 0)
+        run_rpc(argc, argv);
+
+    else {
+        std::cout << "Unrecognized benchmark." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// ------------------------------------------------------------------[ pipeline
+
+namespace {
+    struct tick {
+        uint32_t symbol;
+        uint32_t price;
+    };
+
+    constexpr uint32_t pipeline_messages = 2'000'000;
+
+    // Keeps the compiler from optimizing the work away.
+    std::atomic<uint64_t> sink { 0 };
+
+    // Stands in for real per-message work, so that splitting has something
+    // to overlap.
+    uint64_t work(uint64_t value, int rounds)
+    {
+        for (int i = 0; i < rounds; i++)
+            value = value * 6364136223846793005ull + 1442695040888963407ull;
+        return value;
+    }
+
+    auto consume(std::atomic<uint64_t>& done, int rounds)
+    {
+        return [&done, rounds] (std::vector<uint64_t> batch) {
+            uint64_t checksum = 0;
+            for (auto value : batch)
+                checksum += work(value, rounds);
+            sink.fetch_add(checksum, std::memory_order_relaxed);
+            done.fetch_add(batch.size(), std::memory_order_release);
+        };
+    }
+
+    template <typename Pipeline>
+    void time_pipeline(const char* name, int rounds, Pipeline&& pipeline, const std::atomic<uint64_t>& done)
+    {
+        using win_pipe::tsc_clock;
+
+        auto callback = pipeline.callback();
+        auto begin = tsc_clock::now();
+
+        for (uint32_t i = 0; i < pipeline_messages; i++) {
+            tick t { i % 64, i };
+            callback(reinterpret_cast<uint8_t*>(&t), sizeof(t));
+        }
+        pipeline.flush();
+
+        // The threaded pipelines are still working through their queues.
+        while (done.load(std::memory_order_acquire) < pipeline_messages)
+            SwitchToThread();
+
+        auto elapsed = tsc_clock::to_nanoseconds(tsc_clock::now() - begin);
+        std::printf("%-24s %4d rounds %8.1f ns/msg\n", name, rounds, (double)elapsed / pipeline_messages);
+    }
+}
+
+void run_pipeline()
+{
+    using win_pipe::message_view;
+    using win_pipe::pipeline_builder;
+
+    // Splitting costs a queue hop per message, and pays off only once the
+    // work on either side of it is big enough to overlap.
+    for (int rounds : { 0, 50, 500 }) {
+        auto decode = [] (message_view m) { return *reinterpret_cast<tick*>(m.data); };
+        auto transform = [rounds] (tick t) { return work(t.price, rounds); };
+
+        std::atomic<uint64_t> fused { 0 };
+        time_pipeline("fused", rounds,
+            pipeline_builder {}.map(decode).map(transform).batch(64).dispatch(consume(fused, rounds)),
+            fused);
+
+        std::atomic<uint64_t> before { 0 };
+        time_pipeline("async before transform", rounds,
+            pipeline_builder {}.map(decode).async().map(transform).batch(64).dispatch(consume(before, rounds)),
+            before);
+
+        std::atomic<uint64_t> after { 0 };
+        time_pipeline("async after transform", rounds,
+            pipeline_builder {}.map(decode).map(transform).async().batch(64).dispatch(consume(after, rounds)),
+            after);
+    }
+}
+
+// ------------------------------------------------------------------[ recovery
+
+namespace {
+    constexpr uint32_t recovery_messages = 20'000;
+
+    struct recovery_scenario {
+        const char* name;
+        win_pipe::fault kind;
+        // Whether the receiver or the sender injects the fault.
+        bool at_receiver;
+    };
+
+    // Only touched by the read thread until the receiver is destroyed.
+    struct recovery_state {
+        std::shared_ptr<win_pipe::fault_injector> faults;
+        uint64_t received = 0;
+        uint64_t faults_seen = 0;
+        uint64_t recovery_ticks = 0;
+        uint64_t recoveries = 0;
+    };
+
+    const char* mode_name(win_pipe::connect_mode mode)
+    {
+        switch (mode) {
+        case win_pipe::connect_mode::lazy:
+            return "lazy";
+        case win_pipe::connect_mode::eager:
+            return "eager";
+        default:
+            return "async";
+        }
+    }
+}
+
+void run_recovery()
+{
+    using win_pipe::connect_mode;
+    using win_pipe::fault;
+    using win_pipe::tsc_clock;
+
+    const recovery_scenario scenarios[] {
+        { "receiver disconnect", fault::disconnect, true },
+        { "receiver stall", fault::delay, true },
+        { "sender disconnect", fault::disconnect, false },
+        { "partial write", fault::partial_write, false },
+        { "oversize", fault::oversize, false },
+    };
+
+    std::printf("%-20s %-6s %8s %8s %8s %7s %14s\n",
+        "FAULT", "MODE", "SENT", "RECEIVED", "LOST", "FAULTS", "RECOVERY (us)");
+
+    for (const auto& scenario : scenarios) {
+        for (auto mode : { connect_mode::eager, connect_mode::lazy, connect_mode::async }) {
+            recovery_state state;
+            state.faults = std::make_shared<win_pipe::fault_injector>();
+            state.faults->every(1000, scenario.kind, 500);
+
+            uint64_t sent = 0;
+            {
+                // Recovery is measured from the fault to the next message to
+                // make it through.
+                win_pipe::receiver receiver { "win-pipe_benchmark_recovery",
+                    [&state] (uint8_t*, size_t) {
+                        state.received++;
+                        uint64_t injected = state.faults->injected();
+                        if (injected == state.faults_seen)
+                            return;
+
+                        state.faults_seen = injected;
+                        state.recovery_ticks += tsc_clock::now() - state.faults->last_injected_at();
+                        state.recoveries++;
+                    } };
+                win_pipe::sender sender { "win-pipe_benchmark_recovery", mode };
+
+                if (scenario.at_receiver)
+                    receiver.set_fault_injector(state.faults);
+                else
+                    sender.set_fault_injector(state.faults);
+
+                for (uint32_t i = 0; i < recovery_messages; i++)
+                    sent += sender.send(&i, sizeof(i));
+
+                // Let the receiver catch up before it's torn down.
+                Sleep(200);
+            }
+
+            double recovery = state.recoveries == 0 ? 0.0
+                : (double)tsc_clock::to_nanoseconds(state.recovery_ticks) / state.recoveries / 1000.0;
+            std::printf("%-20s %-6s %8llu %8llu %8llu %7llu %14.1f\n",
+                scenario.name, mode_name(mode), (unsigned long long)sent,
+                (unsigned long long)state.received,
+                (unsigned long long)(recovery_messages - state.received),
+                (unsigned long long)state.faults->injected(), recovery);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------[ scale
+
+namespace {
+    struct footprint {
+        size_t private_bytes;
+        size_t working_set;
+        DWORD handles;
+        DWORD threads;
+        uint64_t cpu_100ns;
+    };
+
+    footprint measure()
+    {
+        footprint result {};
+
+        PROCESS_MEMORY_COUNTERS_EX memory {};
+        memory.cb = sizeof(memory);
+        GetProcessMemoryInfo(GetCurrentProcess(),
+            reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&memory), sizeof(memory));
+        result.private_bytes = memory.PrivateUsage;
+        result.working_set = memory.WorkingSetSize;
+
+        GetProcessHandleCount(GetCurrentProcess(), &result.handles);
+
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        THREADENTRY32 entry {};
+        entry.dwSize = sizeof(entry);
+        for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry))
+            result.threads += entry.th32OwnerProcessID == GetCurrentProcessId();
+        CloseHandle(snapshot);
+
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+        auto to_100ns = [] (FILETIME time) {
+            return ((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime;
+        };
+        result.cpu_100ns = to_100ns(kernel) + to_100ns(user);
+
+        return result;
+    }
+
+    void report(const char* phase, const footprint& before, const footprint& after, size_t channels)
+    {
+        std::printf("%-10s %10.0f B/channel private %10.0f B/channel working set %7lu handles %5lu threads\n",
+            phase,
+            ((double)after.private_bytes - before.private_bytes) / channels,
+            ((double)after.working_set - before.working_set) / channels,
+            (unsigned long)after.handles, (unsigned long)after.threads);
+    }
+
+    template <typename Receiver>
+    void scale(size_t channels)
+    {
+        using win_pipe::tsc_clock;
+
+        std::atomic<uint64_t> received { 0 };
+        auto callback = [&received] (uint8_t*, size_t) {
+            received.fetch_add(1, std::memory_order_relaxed);
+        };
+
+        auto name = [] (size_t i) { return "win-pipe_benchmark_scale_" + std::to_string(i); };
+
+        std::vector<Receiver> receivers;
+        std::vector<win_pipe::sender> senders;
+        receivers.reserve(channels);
+        senders.reserve(channels);
+
+        footprint start = measure();
+        auto begin = tsc_clock::now();
+        for (size_t i = 0; i < channels; i++)
+            receivers.emplace_back(name(i), callback);
+        double receivers_ms = tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e6;
+        footprint after_receivers = measure();
+
+        begin = tsc_clock::now();
+        for (size_t i = 0; i < channels; i++)
+            senders.emplace_back(name(i));
+        double senders_ms = tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e6;
+        footprint after_senders = measure();
+
+        // One message each, which is also when pooled receivers allocate
+        // their buffers.
+        begin = tsc_clock::now();
+        for (size_t i = 0; i < channels; i++)
+            senders[i].send(&i, sizeof(i));
+        while (received.load(std::memory_order_relaxed) < channels)
+            SwitchToThread();
+        double send_ms = tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e6;
+        footprint after_send = measure();
+
+        // Nothing is sent from here on, so any CPU used is overhead.
+        Sleep(5000);
+        footprint idle = measure();
+
+        std::printf("%zu channels: receivers in %.1f ms, senders in %.1f ms, one message each in %.1f ms\n",
+            channels, receivers_ms, senders_ms, send_ms);
+        report("receivers", start, after_receivers, channels);
+        report("+senders", start, after_senders, channels);
+        report("+message", start, after_send, channels);
+        std::printf("idle       %.3f ms CPU per second\n", (idle.cpu_100ns - after_send.cpu_100ns) / 1e4 / 5);
+    }
+}
+
+// Usage: benchmark scale [channels] [pooled|threaded]
+void run_scale(int argc, char** argv)
+{
+    size_t channels = argc >= 3 ? std::stoul(argv[2]) : 10'000;
+    bool threaded = argc >= 4 && strcmp(argv[3], "threaded") == 0;
+
+    if (threaded)
+        scale<win_pipe::receiver>(channels);
+    else
+        scale<win_pipe::pooled_receiver>(channels);
+}
+
+// -------------------------------------------------------------------[ startup
+
+namespace {
+    template <typename Open>
+    void time_startup(const char* name, size_t channels, Open&& open)
+    {
+        using win_pipe::tsc_clock;
+
+        std::vector<std::string> names;
+        for (size_t i = 0; i < channels; i++)
+            names.push_back("win-pipe_benchmark_startup_" + std::to_string(i));
+
+        auto begin = tsc_clock::now();
+        auto receivers = open(names);
+        double elapsed_us = tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e3;
+        DWORD threads = measure().threads;
+
+        begin = tsc_clock::now();
+        receivers.clear();
+        double close_us = tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e3;
+
+        std::printf("%-16s %9.1f ms %8.1f us/channel %6lu threads, closed in %.1f ms\n",
+            name, elapsed_us / 1e3, elapsed_us / channels, (unsigned long)threads, close_us / 1e3);
+    }
+}
+
+// Usage: benchmark startup [channels]
+void run_startup(int argc, char** argv)
+{
+    size_t channels = argc >= 3 ? std::stoul(argv[2]) : 500;
+    auto callback = [] (uint8_t*, size_t) { };
+
+    // Lower bound: what the kernel objects alone cost.
+    time_startup("pipes only", channels, [] (const std::vector<std::string>& names) {
+        std::vector<win_pipe::details::unique_handle> pipes;
+        for (const auto& name : names) {
+            pipes.emplace_back(CreateNamedPipeA(win_pipe::details::format_name(name).c_str(),
+                PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+                PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
+        }
+        return pipes;
+    });
+
+    time_startup("eager receivers", channels, [&] (const std::vector<std::string>& names) {
+        std::vector<win_pipe::receiver> receivers;
+        receivers.reserve(names.size());
+        for (const auto& name : names)
+            receivers.emplace_back(name, callback);
+        return receivers;
+    });
+
+    time_startup("receiver::open", channels, [&] (const std::vector<std::string>& names) {
+        return win_pipe::receiver::open(names, callback);
+    });
+
+    time_startup("pooled receivers", channels, [&] (const std::vector<std::string>& names) {
+        std::vector<win_pipe::pooled_receiver> receivers;
+        receivers.reserve(names.size());
+        for (const auto& name : names)
+            receivers.emplace_back(name, callback);
+        return receivers;
+    });
+}
+
+// ---------------------------------------------------------------------[ merge
+
+namespace {
+    constexpr uint32_t merge_messages = 200'000;
+
+    struct merge_result {
+        double messages_per_second;
+        // Messages passed on before one that was sent earlier.
+        uint64_t out_of_order;
+        uint64_t late;
+    };
+
+    merge_result merge(size_t senders, std::chrono::microseconds window)
+    {
+        using win_pipe::tsc_clock;
+
+        std::atomic<uint64_t> sent { 0 };
+        std::atomic<uint64_t> received { 0 };
+        uint64_t newest = 0;
+        uint64_t out_of_order = 0;
+        win_pipe::multi_receiver receiver { "win-pipe_benchmark_merge",
+            [&] (uint8_t* data, size_t size) {
+                uint64_t sent_at = 0;
+                if (size >= sizeof(sent_at))
+                    std::memcpy(&sent_at, data, sizeof(sent_at));
+                if (sent_at < newest)
+                    out_of_order++;
+                newest = std::max<uint64_t>(newest, sent_at);
+                received++;
+            },
+            senders };
+        receiver.set_merge_window(window);
+
+        uint64_t begin = tsc_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < senders; i++) {
+            threads.emplace_back([&sent] {
+                win_pipe::sender sender { "win-pipe_benchmark_merge" };
+                sender.set_heartbeat_interval(std::chrono::milliseconds { 1 });
+                for (uint32_t j = 0; j < merge_messages; j++) {
+                    uint64_t now = tsc_clock::now();
+                    sent += sender.send(&now, sizeof(now));
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        // Held back messages count once they're passed on.
+        while (received < sent)
+            Sleep(1);
+        double seconds = (double)tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e9;
+
+        return merge_result { received / seconds, out_of_order, receiver.late_count() };
+    }
+}
+
+// Usage: benchmark merge [senders]
+void run_merge(int argc, char** argv)
+{
+    size_t senders = argc >= 3 ? std::stoul(argv[2]) : 4;
+
+    std::printf("%-12s %14s %12s %8s\n", "WINDOW (us)", "MESSAGES/S", "OUT OF ORDER", "LATE");
+    for (long long window : { 0, 100, 1'000, 10'000 }) {
+        merge_result result = merge(senders, std::chrono::microseconds { window });
+        std::printf("%-12lld %14.0f %12llu %8llu\n", window, result.messages_per_second,
+            (unsigned long long)result.out_of_order, (unsigned long long)result.late);
+    }
+}
+
+// -----------------------------------------------------------------------[ ack
+
+namespace {
+    constexpr uint32_t ack_messages = 100'000;
+
+    struct ack_result {
+        double messages_per_second;
+        uint32_t delivered;
+        uint64_t duplicates;
+    };
+
+    // With restart set, the receiver is replaced halfway through, as if its
+    // process had been restarted.
+    ack_result deliver(uint32_t window, bool restart)
+    {
+        using win_pipe::tsc_clock;
+
+        // Only ever touched by one receiver's thread at a time.
+        std::vector<uint8_t> seen(ack_messages);
+        std::atomic<uint32_t> delivered { 0 };
+        std::atomic<uint64_t> duplicates { 0 };
+        auto callback = [&] (uint8_t* data, size_t size) {
+            uint32_t i = 0;
+            if (size != sizeof(i))
+                return;
+            std::memcpy(&i, data, sizeof(i));
+            if (seen[i]++ == 0)
+                delivered++;
+            else
+                duplicates++;
+        };
+
+        auto receiver = std::make_unique<win_pipe::receiver>("win-pipe_benchmark_ack", callback);
+        win_pipe::sender sender { "win-pipe_benchmark_ack" };
+        sender.set_ack_window(window);
+
+        uint64_t begin = tsc_clock::now();
+        for (uint32_t i = 0; i < ack_messages; i++) {
+            if (restart && i == ack_messages / 2) {
+                receiver = nullptr;
+                receiver = std::make_unique<win_pipe::receiver>("win-pipe_benchmark_ack", callback);
+            }
+            sender.send(&i, sizeof(i));
+        }
+
+        // Whatever hasn't arrived after a second is lost.
+        for (int i = 0; i < 1000 && delivered < ack_messages; i++)
+            Sleep(1);
+        double seconds = (double)tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e9;
+
+        receiver = nullptr;
+        return ack_result { delivered / seconds, delivered, duplicates };
+    }
+}
+
+void run_ack()
+{
+    std::printf("%-8s %-8s %14s %9s %10s %10s\n",
+        "WINDOW", "RESTART", "MESSAGES/S", "RELATIVE", "DELIVERED", "DUPLICATES");
+
+    double baseline = 0.0;
+    for (bool restart : { false, true }) {
+        for (uint32_t window : { 0, 16, 256, 4096 }) {
+            ack_result result = deliver(window, restart);
+            if (window == 0 && !restart)
+                baseline = result.messages_per_second;
+
+            std::printf("%-8s %-8s %14.0f %8.2fx %10u %10llu\n",
+                window == 0 ? "off" : std::to_string(window).c_str(), restart ? "yes" : "no",
+                result.messages_per_second, result.messages_per_second / baseline,
+                result.delivered, (unsigned long long)result.duplicates);
+        }
+    }
+}
+
+// --------------------------------------------------------------------[ topics
+
+namespace {
+    constexpr uint32_t topic_messages = 200'000;
+
+    // The receiver wants one topic out of eight, either by saying so, or by
+    // looking at every message in its callback.
+    void route(bool push_down)
+    {
+        using win_pipe::tsc_clock;
+
+        const std::string topics[] { "a", "b", "c", "d", "e", "f", "g", "h" };
+        std::atomic<uint32_t> wanted { 0 };
+        std::atomic<uint32_t> unwanted { 0 };
+        win_pipe::receiver receiver { "win-pipe_benchmark_topics",
+            [&] (uint8_t* data, size_t) {
+                if (data[0] == 'a')
+                    wanted++;
+                else
+                    unwanted++;
+            } };
+        if (push_down)
+            receiver.set_topics({ "a" });
+
+        win_pipe::sender sender { "win-pipe_benchmark_topics" };
+        char message[64] {};
+
+        uint64_t begin = tsc_clock::now();
+        for (uint32_t i = 0; i < topic_messages; i++) {
+            const auto& topic = topics[i % std::size(topics)];
+            message[0] = topic[0];
+            if (push_down)
+                sender.send(topic, message, sizeof(message));
+            else
+                sender.send(message, sizeof(message));
+        }
+        double seconds = (double)tsc_clock::to_nanoseconds(tsc_clock::now() - begin) / 1e9;
+
+        // Let the receiver catch up before counting.
+        Sleep(200);
+        std::printf("%-10s %14.0f %8u %10llu %10llu\n", push_down ? "sender" : "callback",
+            topic_messages / seconds, wanted.load(),
+            (unsigned long long)sender.unwanted_count(),
+            (unsigned long long)(unwanted + receiver.unwanted_count()));
+    }
+}
+
+void run_topics()
+{
+    std::printf("%-10s %14s %8s %10s %10s\n",
+        "FILTERED", "MESSAGES/S", "WANTED", "SKIPPED", "CROSSED");
+    route(false);
+    route(true);
+}
+
+// -----------------------------------------------------------------------[ rpc
+
+// Round trips through rpc_server and rpc_client, with the server echoing the
+// request back. Both ends run in this process, on separate threads, which
+// costs the same as separate processes: everything goes through the shared
+// mapping either way.
+//
+// Usage: benchmark rpc [request bytes]
+void run_rpc(int argc, char** argv)
+{
+    using win_pipe::tsc_clock;
+
+    constexpr size_t warmup = 10'000;
+    constexpr size_t calls = 1'000'000;
+    size_t request_size = argc >= 3 ? std::stoul(argv[2]) : 64;
+
+    win_pipe::rpc_server server { "win-pipe_benchmark_rpc",
+        [] (const uint8_t* request, size_t size, uint8_t* response, size_t capacity) {
+            size = std::min<size_t>(size, capacity);
+            std::memcpy(response, request, size);
+            return size;
+        } };
+    win_pipe::rpc_client client { "win-pipe_benchmark_rpc" };
+
+    std::vector<uint8_t> request(request_size);
+    std::vector<uint8_t> response;
+    std::vector<uint64_t> round_trips;
+    round_trips.reserve(calls);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < warmup + calls; i++) {
+        uint64_t begin = tsc_clock::now();
+        failed += !client.call(request.data(), (DWORD)request.size(), response);
+        uint64_t end = tsc_clock::now();
+        if (i >= warmup)
+            round_trips.push_back(tsc_clock::to_nanoseconds(end - begin));
+    }
+
+    uint64_t total = 0;
+    for (uint64_t round_trip : round_trips)
+        total += round_trip;
+    std::sort(round_trips.begin(), round_trips.end());
+    auto percentile = [&] (double p) { return round_trips[(size_t)(p * (round_trips.size() - 1))]; };
+
+    std::printf("%-8s %10s %10s %10s %10s %12s %8s\n",
+        "BYTES", "P50 (ns)", "P99 (ns)", "P99.9 (ns)", "MEAN (ns)", "CALLS/S", "FAILED");
+    std::printf("%-8zu %10llu %10llu %10llu %10.0f %12.0f %8zu\n", request_size,
+        (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.99),
+        (unsigned long long)percentile(0.999), (double)total / calls,
+        calls / ((double)total / 1e9), failed);
+}
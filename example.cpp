@@ -1,7 +1,6 @@
 #include "win-pipe.h"
 
 #include <array>
-#include <chrono>
 #include <iostream>
 
 void run_receiver();
@@ -56,19 +55,19 @@ void run_receiver()
 
 void receiver_callback1(uint8_t* data, [[maybe_unused]] size_t size)
 {
-    using namespace std::chrono;
+    using win_pipe::tsc_clock;
 
     static int count = 0;
     int oldCount = count;
     count++;
 
-    auto end = high_resolution_clock::now();
+    auto end = tsc_clock::now();
 
     if (oldCount % 2 == 0)
     {
         auto* start = reinterpret_cast<decltype(end)*>(data);
-        auto latency = duration_cast<nanoseconds>(end - *start);
-        std::cout << "latency: " << latency.count() << "ns\n";
+        auto latency = tsc_clock::to_nanoseconds(end - *start);
+        std::cout << "latency: " << latency << "ns\n";
     }
     else
     {
@@ -79,19 +78,19 @@ void receiver_callback1(uint8_t* data, [[maybe_unused]] size_t size)
 
 void receiver_callback2([[maybe_unused]] uint8_t* data, size_t size)
 {
-    using namespace std::chrono;
+    using win_pipe::tsc_clock;
 
     static int count = 0;
     int oldCount = count;
     count++;
 
-    auto end = high_resolution_clock::now();
+    auto end = tsc_clock::now();
 
     if (oldCount % 2 == 0)
     {
         auto* start = reinterpret_cast<decltype(end)*>(data);
-        auto latency = duration_cast<nanoseconds>(end - *start);
-        std::cout << "latency: " << latency.count() << "ns\n";
+        auto latency = tsc_clock::to_nanoseconds(end - *start);
+        std::cout << "latency: " << latency << "ns\n";
     }
     else
     {
@@ -101,7 +100,7 @@ void receiver_callback2([[maybe_unused]] uint8_t* data, size_t size)
 
 void run_sender()
 {
-    using namespace std::chrono;
+    using win_pipe::tsc_clock;
 
     std::cout << "Send messages to the receiver! Type exit to quit." << std::endl;
 
@@ -110,7 +109,7 @@ void run_sender()
     std::string message;
     while (true) {
         std::getline(std::cin, message);
-        auto start = high_resolution_clock::now();
+        auto start = tsc_clock::now();
 
         sender.send(&start, sizeof(decltype(start)));
         sender.send(message.c_str(), (DWORD)message.length() + 1);
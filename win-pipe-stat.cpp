@@ -0,0 +1,105 @@
+#include "win-pipe.h"
+
+#include <TlHelp32.h>
+
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <utility>
+
+// Prints the counters of every win-pipe channel on the machine, refreshed
+// every second like top. Pass "once" to print a single snapshot and exit.
+
+std::vector<win_pipe::channel_snapshot> read_all(std::map<DWORD, uint32_t>& dropped);
+void print(const std::vector<win_pipe::channel_snapshot>& current,
+    const std::map<std::pair<DWORD, uint32_t>, win_pipe::channel_snapshot>& previous,
+    const std::map<DWORD, uint32_t>& dropped, double seconds);
+
+int main(int argc, char** argv)
+{
+    bool once = argc >= 2 && strcmp(argv[1], "once") == 0;
+
+    std::map<std::pair<DWORD, uint32_t>, win_pipe::channel_snapshot> previous;
+    ULONGLONG previous_at = GetTickCount64();
+
+    while (true) {
+        std::map<DWORD, uint32_t> dropped;
+        auto current = read_all(dropped);
+        ULONGLONG now = GetTickCount64();
+
+        if (!once)
+            std::cout << "\x1b[2J\x1b[H";
+        print(current, previous, dropped, (now - previous_at) / 1000.0);
+
+        if (once)
+            break;
+
+        previous.clear();
+        for (auto& snapshot : current)
+            previous[{ snapshot.pid, snapshot.id }] = snapshot;
+        previous_at = now;
+
+        Sleep(1000);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+std::vector<win_pipe::channel_snapshot> read_all(std::map<DWORD, uint32_t>& dropped)
+{
+    std::vector<win_pipe::channel_snapshot> all;
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return all;
+
+    PROCESSENTRY32 entry {};
+    entry.dwSize = sizeof(entry);
+    for (BOOL more = Process32First(snapshot, &entry); more; more = Process32Next(snapshot, &entry)) {
+        auto channels = win_pipe::stats::read(entry.th32ProcessID);
+        all.insert(all.end(), channels.begin(), channels.end());
+
+        // Channels that didn't fit in the process's registry.
+        if (uint32_t missing = win_pipe::stats::dropped(entry.th32ProcessID))
+            dropped[entry.th32ProcessID] = missing;
+    }
+
+    CloseHandle(snapshot);
+    return all;
+}
+
+void print(const std::vector<win_pipe::channel_snapshot>& current,
+    const std::map<std::pair<DWORD, uint32_t>, win_pipe::channel_snapshot>& previous,
+    const std::map<DWORD, uint32_t>& dropped, double seconds)
+{
+    std::printf("%-8s %-9s %-32s %10s %12s %12s %10s %8s %8s\n",
+        "PID", "KIND", "NAME", "MSG/S", "BYTES/S", "MESSAGES", "QUEUED", "IDLE(s)", "RECONN");
+
+    ULONGLONG now = GetTickCount64();
+    for (auto& snapshot : current) {
+        double message_rate = 0;
+        double byte_rate = 0;
+
+        // Rates need two samples, so the first screen shows only totals.
+        auto it = previous.find({ snapshot.pid, snapshot.id });
+        if (it != previous.end() && seconds > 0 && it->second.name == snapshot.name) {
+            message_rate = (snapshot.messages - it->second.messages) / seconds;
+            byte_rate = (snapshot.bytes - it->second.bytes) / seconds;
+        }
+
+        const char* kind = snapshot.kind == win_pipe::channel_kind::receiver ? "receiver" : "sender";
+        double idle = now > snapshot.last_activity ? (now - snapshot.last_activity) / 1000.0 : 0;
+
+        std::printf("%-8lu %-9s %-32.32s %10.0f %12.0f %12llu %10llu %8.1f %8llu\n",
+            (unsigned long)snapshot.pid, kind, snapshot.name.c_str(), message_rate, byte_rate,
+            (unsigned long long)snapshot.messages, (unsigned long long)snapshot.queue_depth,
+            idle, (unsigned long long)snapshot.reconnects);
+    }
+
+    for (auto& [pid, missing] : dropped) {
+        std::printf("%-8lu registry full, %lu more channels not shown\n",
+            (unsigned long)pid, (unsigned long)missing);
+    }
+
+    std::fflush(stdout);
+}
@@ -23,17 +23,76 @@
 #endif
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include <iostream>
 
+// The metrics endpoint needs Winsock, which has to come before Windows.h and
+// means linking Ws2_32, so it's left out unless asked for.
+#ifdef WIN_PIPE_ENABLE_METRICS_SERVER
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
 #include <Windows.h>
 
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+// Static probes on the hot paths, for watching a live process with ETW
+// tools (WPR/WPA, tracelog, PerfView, ...). Define WIN_PIPE_ENABLE_PROBES
+// before including win-pipe.h everywhere, and WIN_PIPE_PROBES_IMPLEMENTATION
+// as well in exactly one .cpp. Without WIN_PIPE_ENABLE_PROBES, probes compile
+// to nothing; with it, they cost a single check until a session attaches to
+// the "win-pipe" provider.
+#ifdef WIN_PIPE_ENABLE_PROBES
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(win_pipe_provider);
+
+#define WIN_PIPE_PROBE(name, ...) TraceLoggingWrite(win_pipe_provider, name, __VA_ARGS__)
+
+#ifdef WIN_PIPE_PROBES_IMPLEMENTATION
+// {8195022b-2b48-43f8-89ff-1a78abcfa6d1}
+TRACELOGGING_DEFINE_PROVIDER(win_pipe_provider, "win-pipe",
+    (0x8195022b, 0x2b48, 0x43f8, 0x89, 0xff, 0x1a, 0x78, 0xab, 0xcf, 0xa6, 0xd1));
+
+namespace win_pipe::details {
+    struct probe_registration {
+        probe_registration()
+        {
+            TraceLoggingRegister(win_pipe_provider);
+        }
+
+        ~probe_registration()
+        {
+            TraceLoggingUnregister(win_pipe_provider);
+        }
+    };
+
+    static probe_registration probes_registered;
+}
+#endif
+#else
+#define WIN_PIPE_PROBE(name, ...) ((void)0)
+#endif
+
 namespace win_pipe {
 
 namespace details {
@@ -53,175 +112,6376 @@ namespace details {
     };
 
     using unique_handle = std::unique_ptr<void, handle_deleter>;
-}
 
-using callback_t = std::function<void(uint8_t*, size_t)>;
+    struct view_deleter {
+        void operator()(void* view)
+        {
+            if (view != NULL)
+                UnmapViewOfFile(view);
+        }
+    };
 
-// -------------------------------------------------------------------[ receiver
+    using unique_view = std::unique_ptr<void, view_deleter>;
 
-class receiver {
-public:
     /// <summary>
-    /// Default constructor. Does nothing. No pipe is opened/created, and no
-    /// read thread is started.
-    /// <para/>
-    /// Note: remember that move constructor exists. This constructor is mainly
-    /// meant for use with containers which require a default constructor.
+    /// Name for a kernel object (file mapping, event, ...) belonging to the
+    /// given channel. Kept apart from pipe names, which live in their own
+    /// namespace anyway.
     /// </summary>
-    receiver() = default;
+    static inline std::string format_object_name(std::string_view kind,
+        std::string_view name)
+    {
+        std::string formatted = "win-pipe_";
+        formatted += kind;
+        formatted += '_';
+        formatted += name;
+        return formatted;
+    }
 
-    receiver(std::string_view name, callback_t callback)
+    /// <summary>
+    /// Creates (or, if create is false, opens) a named chunk of shared memory
+    /// and maps all of it. Throws on failure, including when creating one that
+    /// already exists.
+    /// </summary>
+    static inline unique_view map_shared_memory(const std::string& name,
+        size_t size, bool create, unique_handle& mapping)
     {
-        m_param = std::make_unique<thread_param>();
+        if (create) {
+            mapping.reset(CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str()));
+            if (mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+                mapping = nullptr;
+        } else {
+            mapping.reset(OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str()));
+        }
 
-        std::string pipe_name { details::format_name(name) };
-        m_param->pipe.reset(CreateNamedPipeA(
-            pipe_name.c_str(),
-            PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE,
-            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-            1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
-        if (m_param->pipe.get() == INVALID_HANDLE_VALUE) {
-            std::string msg { "Pipe creation failed: " };
+        unique_view view;
+        if (mapping)
+            view.reset(MapViewOfFile(mapping.get(), FILE_MAP_ALL_ACCESS, 0, 0, 0));
+
+        if (!view) {
+            std::string msg { "Shared memory mapping failed: " };
             msg += std::to_string(GetLastError());
             throw std::runtime_error(msg);
         }
 
-        m_param->callback = callback;
-        m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        return view;
+    }
 
-        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    /// <summary>
+    /// Whether the process runs as the same user as this one. Anything that
+    /// can't be checked counts as not.
+    /// </summary>
+    static inline bool same_user(HANDLE process)
+    {
+        auto user_of = [] (HANDLE process, std::vector<uint8_t>& buffer) -> PSID {
+            HANDLE token = NULL;
+            if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+                return nullptr;
+
+            unique_handle owned { token };
+            DWORD size = 0;
+            GetTokenInformation(token, TokenUser, NULL, 0, &size);
+            buffer.resize(size);
+            if (size == 0 || !GetTokenInformation(token, TokenUser, buffer.data(), size, &size))
+                return nullptr;
+
+            return reinterpret_cast<TOKEN_USER*>(buffer.data())->User.Sid;
+        };
+
+        std::vector<uint8_t> ours;
+        std::vector<uint8_t> theirs;
+        PSID our_user = user_of(GetCurrentProcess(), ours);
+        PSID their_user = user_of(process, theirs);
+        return our_user && their_user && EqualSid(our_user, their_user);
     }
 
-    receiver(receiver&&) noexcept = default;
+    /// <summary>
+    /// When the process was created, for telling it apart from a later one
+    /// that reuses its id. 0 if that can't be found out.
+    /// </summary>
+    static inline uint64_t process_created_at(HANDLE process)
+    {
+        FILETIME created {}, exited {}, kernel {}, user {};
+        if (!GetProcessTimes(process, &created, &exited, &kernel, &user))
+            return 0;
 
-    ~receiver()
+        return ((uint64_t)created.dwHighDateTime << 32) | created.dwLowDateTime;
+    }
+
+    /// <summary>
+    /// Whether the process has exited. One that can't be opened only counts
+    /// as exited if there's no process with that id at all: being denied
+    /// access, e.g. to an elevated process, says nothing either way. If
+    /// created_at is given, a process with the same id but created at
+    /// another time is a different one, so the original has exited.
+    /// </summary>
+    static inline bool process_exited(DWORD pid, uint64_t created_at = 0)
     {
-        if (m_param)
-            SetEvent(m_param->event.get());
+        DWORD access = created_at != 0 ? SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION : SYNCHRONIZE;
+        HANDLE process = OpenProcess(access, FALSE, pid);
+        if (!process)
+            return GetLastError() == ERROR_INVALID_PARAMETER;
 
-        CancelSynchronousIo(m_thread.get());
-        WaitForSingleObject(m_thread.get(), INFINITE);
+        unique_handle owned { process };
+        if (WaitForSingleObject(process, 0) == WAIT_OBJECT_0)
+            return true;
+
+        uint64_t actual = created_at != 0 ? process_created_at(process) : 0;
+        return actual != 0 && actual != created_at;
     }
 
-    receiver& operator=(receiver&&) noexcept = default;
+    /// <summary>
+    /// How many times to spin on shared memory before falling back to
+    /// sleeping on an event. Roughly a few microseconds' worth.
+    /// </summary>
+    inline constexpr int spin_count = 4000;
 
-    void set_callback(callback_t callback)
+    /// <summary>
+    /// Prefixed to every message on the wire by the sender and stripped off
+    /// by the receiver before the callback sees the data.
+    /// </summary>
+    struct message_header {
+        // steady_clock ticks since epoch, or 0 for no deadline. steady_clock
+        // is backed by QueryPerformanceCounter, so it is comparable across
+        // processes on the same machine.
+        int64_t deadline;
+        // tsc_clock ticks from just before the message was written. Set on
+        // heartbeats too, so that a merging receiver knows an idle sender
+        // has nothing older on the way.
+        uint64_t sent_at;
+        // Numbers a sender's messages from 1, so receivers can tell senders'
+        // streams apart and spot gaps. 0 for heartbeats.
+        uint64_t sequence;
+        uint32_t flags;
+        // topic_id of the message's topic, or 0 if it has none.
+        uint32_t topic;
+    };
+
+    /// <summary>
+    /// Sent by the old receiver to its successor during a handover. Followed
+    /// by a second message holding the leftover message, if there is one.
+    /// </summary>
+    struct handover_header {
+        uint64_t pipe;
+        uint32_t leftover_size;
+        uint32_t reserved;
+    };
+
+    static inline std::string format_handover_name(std::string_view name)
     {
-        if (!m_param)
-            return;
+        std::string formatted = format_name(name);
+        formatted += "-handover";
+        return formatted;
+    }
 
-        std::lock_guard lock { m_param->callback_mutex };
-        m_param->callback = callback;
+    /// <summary>
+    /// Waits up to timeout for an overlapped operation that was just started
+    /// to finish. Returns false if it failed or timed out, in which case it
+    /// has also been cancelled.
+    /// </summary>
+    static inline bool finish_overlapped(HANDLE handle, OVERLAPPED& overlapped,
+        BOOL started, DWORD timeout, DWORD& bytes)
+    {
+        if (!started && GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        if (WaitForSingleObject(overlapped.hEvent, timeout) == WAIT_TIMEOUT) {
+            CancelIoEx(handle, &overlapped);
+            GetOverlappedResult(handle, &overlapped, &bytes, TRUE);
+            return false;
+        }
+
+        return GetOverlappedResult(handle, &overlapped, &bytes, FALSE);
     }
 
-private:
-    static DWORD WINAPI thread(LPVOID lp)
+    /// <summary>
+    /// Milliseconds left until a GetTickCount64() deadline, or 0 if it has
+    /// passed.
+    /// </summary>
+    static inline DWORD time_left(ULONGLONG deadline)
     {
-        auto* param = reinterpret_cast<thread_param*>(lp);
-        auto pipe = param->pipe.get();
-        auto event = param->event.get();
-        auto& callback = param->callback;
-        auto& callback_mutex = param->callback_mutex;
+        ULONGLONG now = GetTickCount64();
+        return now < deadline ? (DWORD)std::min<ULONGLONG>(deadline - now, INFINITE - 1) : 0;
+    }
 
-        std::vector<uint8_t> buffer(1024);
+    /// <summary>
+    /// Same as above, except that instead of a timeout, it gives up as soon as
+    /// the stop event is signaled. GetLastError() is ERROR_OPERATION_ABORTED
+    /// after giving up.
+    /// </summary>
+    static inline bool finish_overlapped(HANDLE handle, OVERLAPPED& overlapped,
+        BOOL started, HANDLE stop, DWORD& bytes)
+    {
+        if (!started && GetLastError() != ERROR_IO_PENDING)
+            return false;
 
-        while (WaitForSingleObject(event, 1) == WAIT_TIMEOUT) {
-            ConnectNamedPipe(pipe, NULL);
+        HANDLE handles[] { stop, overlapped.hEvent };
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+            CancelIoEx(handle, &overlapped);
+            GetOverlappedResult(handle, &overlapped, &bytes, TRUE);
+            SetLastError(ERROR_OPERATION_ABORTED);
+            return false;
+        }
 
-            while (WaitForSingleObject(event, 1) == WAIT_TIMEOUT) {
-                DWORD bytes_read = 0;
-                if (!ReadFile(pipe, buffer.data(), (DWORD)buffer.size(), &bytes_read, NULL)) {
-                    if (GetLastError() != ERROR_MORE_DATA)
-                        break;
+        return GetOverlappedResult(handle, &overlapped, &bytes, FALSE);
+    }
 
-                    DWORD leftover = 0;
-                    PeekNamedPipe(pipe, NULL, NULL, NULL, NULL, &leftover);
-                    buffer.resize(bytes_read + leftover);
+    namespace message_flags {
+        // Sent by an idle sender to show it's still alive. Never reaches the
+        // callback.
+        inline constexpr uint32_t heartbeat = 1 << 0;
+        // Starts every connection of a sender with acknowledgements on, and
+        // is followed by hello_message. Never reaches the callback.
+        inline constexpr uint32_t hello = 1 << 1;
+        // On messages from a sender with acknowledgements on.
+        inline constexpr uint32_t ack_requested = 1 << 2;
+        // Sent back by the receiver. sequence is the last message it has
+        // passed to the callback, and so covers everything before it too.
+        inline constexpr uint32_t ack = 1 << 3;
+        // Sent back by the receiver when a sender connects, and whenever its
+        // topics change. Followed by the sorted topic_ids it wants, or by
+        // nothing if it wants everything.
+        inline constexpr uint32_t topics = 1 << 4;
+    }
 
-                    DWORD more_bytes_read = 0;
-                    ReadFile(pipe, buffer.data() + bytes_read, leftover, &more_bytes_read, NULL);
-                    bytes_read += more_bytes_read;
-                }
-                std::lock_guard lock { callback_mutex };
-                callback(buffer.data(), (size_t)bytes_read);
-            }
+    /// <summary>
+    /// 32-bit FNV-1a of the topic, which is what goes on the wire. 0 is left
+    /// for messages without a topic.
+    /// </summary>
+    static inline uint32_t topic_id(std::string_view topic)
+    {
+        uint32_t hash = 2166136261u;
+        for (char c : topic) {
+            hash ^= (uint8_t)c;
+            hash *= 16777619u;
+        }
+        return hash != 0 ? hash : 1;
+    }
 
-            DisconnectNamedPipe(pipe);
+    struct hello_message {
+        // Picked at random by the sender, so that a receiver can tell whether
+        // a reconnecting sender is the one it already got messages from.
+        uint64_t stream_id;
+        // Most messages the sender keeps waiting for acknowledgement.
+        uint32_t window;
+        uint32_t reserved;
+    };
+
+    static inline void frame_message(std::vector<uint8_t>& message,
+        const message_header& header, const void* buffer, DWORD size)
+    {
+        message.resize(sizeof(header) + size);
+        std::memcpy(message.data(), &header, sizeof(header));
+        std::memcpy(message.data() + sizeof(header), buffer, size);
+    }
+
+    /// <summary>
+    /// Whether a message read off the pipe should be passed on to the
+    /// callback, as opposed to being malformed, a heartbeat or hello, or
+    /// expired (which is counted).
+    /// </summary>
+    static inline bool accept_message(const uint8_t* data, DWORD size,
+        std::atomic<uint64_t>& expired_count, message_header& header)
+    {
+        if (size < sizeof(header))
+            return false;
+        std::memcpy(&header, data, sizeof(header));
+
+        if (header.flags & (message_flags::heartbeat | message_flags::hello))
+            return false;
+
+        // Only hit the clock when the sender actually asked for a deadline, so
+        // plain messages stay as cheap as before.
+        if (header.deadline != 0
+            && std::chrono::steady_clock::now().time_since_epoch().count() > header.deadline) {
+            expired_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
         }
 
-        return TRUE;
+        return true;
     }
+}
 
-private:
-    struct thread_param {
-        details::unique_handle pipe;
-        details::unique_handle event;
-        std::mutex callback_mutex;
-        callback_t callback;
-    };
+using callback_t = std::function<void(uint8_t*, size_t)>;
 
-private:
-    std::unique_ptr<thread_param> m_param;
-    details::unique_handle m_thread;
+/// <summary>
+/// Where a message came from, for callbacks that need to tell senders
+/// apart. Everything but received_at is looked up once per connection, not
+/// per message.
+/// </summary>
+struct message_info {
+    // Numbers the receiver's connections from 1, in the order they were made.
+    uint64_t connection_id;
+    DWORD pid;
+    // The sender's own count of messages sent, from 1. Gaps mean messages
+    // were lost or skipped on the way.
+    uint64_t sequence;
+    // tsc_clock time at which the message was read.
+    uint64_t received_at;
 };
 
-// ---------------------------------------------------------------------[ sender
+using extended_callback_t = std::function<void(uint8_t*, size_t, const message_info&)>;
 
-class sender {
-public:
+/// <summary>
+/// Picks the constructors that take an extended_callback_t. Needed because
+/// some callables, e.g. std::bind expressions, convert to both callback
+/// types, which would make overloading on the type alone ambiguous.
+/// </summary>
+struct with_info_t {
+    explicit with_info_t() = default;
+};
+
+inline constexpr with_info_t with_info {};
+using deadline_t = std::chrono::steady_clock::time_point;
+
+/// <summary>
+/// Passed to sender::send to indicate that a message never expires.
+/// </summary>
+inline constexpr deadline_t no_deadline {};
+
+/// <summary>
+/// When a sender first connects to its pipe.
+/// </summary>
+enum class connect_mode {
+    // On the first send. That send pays for connecting.
+    lazy,
+    // In the constructor. If there's no receiver yet, falls back to lazy.
+    eager,
+    // In the background, waiting for the pipe to be created or to stop being
+    // busy, so the connection is ready before the first send.
+    async,
+};
+
+/// <summary>
+/// When a receiver starts its read thread.
+/// </summary>
+enum class start_mode {
+    // In the constructor.
+    eager,
+    // Once the first sender connects. Until then, the thread pool waits for
+    // the connection on the receiver's behalf.
+    lazy,
+};
+
+// ------------------------------------------------------------------[ tsc_clock
+
+namespace details {
     /// <summary>
-    /// Default constructor. Does nothing. Cannot actually write to a pipe.
-    /// <para />
-    /// Note: remember that move constructor exists. This constructor is mainly
-    /// meant for use with containers which require a default constructor.
+    /// Measured by whichever process needs it first, and shared with every
+    /// other process running at the time through shared memory, so that they
+    /// all convert ticks the exact same way.
     /// </summary>
-    sender() = default;
+    struct clock_calibration {
+        enum : uint32_t {
+            uncalibrated,
+            calibrating,
+            // use_tsc and multiplier are being written.
+            publishing,
+            ready,
+        };
+
+        std::atomic<uint32_t> state;
+        uint32_t use_tsc;
+        // Nanoseconds per tick, in 32.32 fixed point.
+        uint64_t multiplier;
+    };
+
+    // Calibrating takes ~20ms, so one that's taken this long is assumed to
+    // have died on the way.
+    inline constexpr ULONGLONG clock_calibration_timeout = 200;
+
+    struct clock_state {
+        bool use_tsc;
+        uint64_t multiplier;
+    };
 
-    sender(std::string_view name)
-        : m_name { details::format_name(name) }
+    static inline uint64_t read_qpc()
     {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return (uint64_t)counter.QuadPart;
     }
 
-    sender(sender&&) noexcept = default;
+    static inline bool has_invariant_tsc()
+    {
+#if defined(_M_X64) || defined(_M_IX86)
+        int info[4];
+        __cpuid(info, 0x80000000);
+        if ((unsigned)info[0] < 0x80000007)
+            return false;
 
-    sender& operator=(sender&&) noexcept = default;
+        __cpuid(info, 0x80000007);
+        return (info[3] & (1 << 8)) != 0;
+#else
+        return false;
+#endif
+    }
 
-    bool send(const void* buffer, DWORD size)
+    static inline uint64_t read_ticks(bool use_tsc)
     {
-        if (WriteFile(m_pipe.get(), buffer, size, NULL, NULL) == FALSE) {
-            DWORD error = GetLastError();
-            switch (error) {
-            case ERROR_INVALID_HANDLE:
-            case ERROR_PIPE_NOT_CONNECTED:
-                connect();
-                break;
-            default:
-                return false;
-            }
+#if defined(_M_X64) || defined(_M_IX86)
+        if (use_tsc)
+            return __rdtsc();
+#endif
+        (void)use_tsc;
+        return read_qpc();
+    }
 
-            if (WriteFile(m_pipe.get(), buffer, size, NULL, NULL) == FALSE)
-                return false;
+    static inline void calibrate(clock_calibration& calibration)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+
+        bool use_tsc = has_invariant_tsc();
+        double ticks_per_second = (double)frequency.QuadPart;
+        if (use_tsc) {
+            uint64_t qpc_begin = read_qpc();
+            uint64_t tsc_begin = read_ticks(true);
+            Sleep(20);
+            uint64_t qpc_end = read_qpc();
+            uint64_t tsc_end = read_ticks(true);
+
+            ticks_per_second = (double)(tsc_end - tsc_begin) * (double)frequency.QuadPart
+                / (double)(qpc_end - qpc_begin);
         }
 
-        FlushFileBuffers(m_pipe.get());
-        return true;
+        calibration.use_tsc = use_tsc;
+        calibration.multiplier = (uint64_t)(1e9 / ticks_per_second * 4294967296.0);
     }
 
-private:
-    void connect()
+    static inline bool wait_for_clock(const clock_calibration& calibration)
     {
-        // In order to CloseHandle before CreateFile, you need to destroy
-        // what's inside the unique_ptr by either calling reset() or assigning
-        // it nullptr.
-        m_pipe = nullptr;
-        m_pipe.reset(CreateFileA(m_name.c_str(), GENERIC_WRITE,
-            FILE_SHARE_READ, NULL, OPEN_ALWAYS, NULL,
-            NULL));
+        ULONGLONG deadline = GetTickCount64() + clock_calibration_timeout;
+        while (calibration.state.load() != clock_calibration::ready && GetTickCount64() < deadline)
+            Sleep(1);
+        return calibration.state.load() == clock_calibration::ready;
+    }
+
+    /// <summary>
+    /// Publishes a calibration unless another process got there first, and
+    /// returns whichever one is published. Only if that can't be had either
+    /// is the process left with its own measurement, in which case its
+    /// timestamps are only comparable with its own.
+    /// </summary>
+    static inline clock_state publish_clock(clock_calibration& shared, const clock_calibration& measured)
+    {
+        uint32_t state = clock_calibration::calibrating;
+        if (shared.state.compare_exchange_strong(state, clock_calibration::publishing)) {
+            shared.use_tsc = measured.use_tsc;
+            shared.multiplier = measured.multiplier;
+            shared.state.store(clock_calibration::ready);
+        }
+        else if (!wait_for_clock(shared)) {
+            return { measured.use_tsc != 0, measured.multiplier };
+        }
+
+        return { shared.use_tsc != 0, shared.multiplier };
+    }
+
+    static inline clock_state load_clock()
+    {
+        // The mapping is deliberately never closed, so that the calibration
+        // stays around for as long as this process runs. Once the last
+        // process holding it exits, the next one calibrates again.
+        std::string name { format_object_name("clock", "calibration") };
+        HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            0, sizeof(clock_calibration), name.c_str());
+        void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+
+        // Without shared memory, timestamps are process-local.
+        clock_calibration measured {};
+        if (!view) {
+            calibrate(measured);
+            return { measured.use_tsc != 0, measured.multiplier };
+        }
+
+        // One process calibrates while the rest wait for it. If that takes
+        // too long, e.g. because it died on the way, the rest calibrate too,
+        // and the first to finish publishes for everyone.
+        auto* calibration = reinterpret_cast<clock_calibration*>(view);
+        uint32_t state = clock_calibration::uncalibrated;
+        if (!calibration->state.compare_exchange_strong(state, clock_calibration::calibrating)
+            && wait_for_clock(*calibration))
+            return { calibration->use_tsc != 0, calibration->multiplier };
+
+        calibrate(measured);
+        return publish_clock(*calibration, measured);
+    }
+
+    // Not static, so that it's looked up once per process rather than once
+    // per translation unit.
+    inline const clock_state& get_clock()
+    {
+        static const clock_state clock = load_clock();
+        return clock;
+    }
+
+    /// <summary>
+    /// ticks * multiplier >> 32, without overflowing.
+    /// </summary>
+    static inline uint64_t scale_ticks(uint64_t ticks, uint64_t multiplier)
+    {
+        uint64_t ticks_high = ticks >> 32, ticks_low = ticks & 0xFFFFFFFF;
+        uint64_t mult_high = multiplier >> 32, mult_low = multiplier & 0xFFFFFFFF;
+        return ((ticks_high * mult_high) << 32) + ticks_high * mult_low
+            + ticks_low * mult_high + ((ticks_low * mult_low) >> 32);
+    }
+}
+
+/// <summary>
+/// Cheap timestamps that can be compared between processes on the same
+/// machine. Reads the invariant TSC where the CPU has one (a few nanoseconds,
+/// versus tens for std::chrono clocks), and QueryPerformanceCounter
+/// otherwise. The tick rate is calibrated once per machine and shared by all
+/// processes.
+/// <para/>
+/// Note: the first call in each process looks up the calibration, and the
+/// first while no other process has it spends ~20ms measuring it. If the
+/// calibration can't be shared (no shared memory, or the process publishing
+/// it died halfway through), the process uses its own, and its timestamps
+/// can then only be compared with its own.
+/// </summary>
+class tsc_clock {
+public:
+    static uint64_t now()
+    {
+        return details::read_ticks(details::get_clock().use_tsc);
+    }
+
+    static uint64_t to_nanoseconds(uint64_t ticks)
+    {
+        return details::scale_ticks(ticks, details::get_clock().multiplier);
+    }
+
+    static uint64_t nanoseconds()
+    {
+        return to_nanoseconds(now());
+    }
+};
+
+// --------------------------------------------------------------------[ tracing
+
+namespace details {
+    struct trace_event {
+        const char* name;
+        uint64_t begin;
+        uint64_t end;
+        uint32_t bytes;
+        DWORD thread_id;
+    };
+
+    /// <summary>
+    /// One slot of a trace_ring. The exporter reads slots while their thread
+    /// may be overwriting them, so each is a seqlock: sequence is odd while
+    /// being written, and 2 * (index + 1) once the event with that index is
+    /// in.
+    /// </summary>
+    struct trace_slot {
+        std::atomic<uint64_t> sequence { 0 };
+        std::atomic<const char*> name { nullptr };
+        std::atomic<uint64_t> begin { 0 };
+        std::atomic<uint64_t> end { 0 };
+        std::atomic<uint32_t> bytes { 0 };
+        std::atomic<DWORD> thread_id { 0 };
+    };
+
+    /// <summary>
+    /// Written only by the thread it currently belongs to, read by the
+    /// exporter. Once full, the oldest events get overwritten.
+    /// </summary>
+    struct trace_ring {
+        static constexpr size_t capacity = 4096;
+
+        std::atomic<uint64_t> head { 0 };
+        // Whether a thread is using it. Guarded by the registry's mutex.
+        bool in_use = false;
+        trace_slot slots[capacity];
+    };
+
+    struct trace_registry {
+        std::atomic<bool> enabled { false };
+        std::mutex mutex;
+        // Rings stay here after their thread exits, so nothing is lost
+        // before it's exported, until a new thread reuses them. So there are
+        // only ever as many as there were threads tracing at once.
+        std::vector<std::shared_ptr<trace_ring>> rings;
+    };
+
+    // Not static, so that every translation unit records to, and exports
+    // from, the same registry.
+    inline trace_registry& get_trace_registry()
+    {
+        static trace_registry registry;
+        return registry;
+    }
+
+    inline bool tracing_enabled()
+    {
+        return get_trace_registry().enabled.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// A thread's claim on a ring, given back when the thread exits.
+    /// </summary>
+    struct trace_ring_owner {
+        trace_ring* ring = nullptr;
+        DWORD thread_id = GetCurrentThreadId();
+
+        trace_ring_owner()
+        {
+            auto& registry = get_trace_registry();
+            std::lock_guard lock { registry.mutex };
+            for (auto& candidate : registry.rings) {
+                if (!candidate->in_use) {
+                    ring = candidate.get();
+                    break;
+                }
+            }
+            if (!ring) {
+                registry.rings.push_back(std::make_shared<trace_ring>());
+                ring = registry.rings.back().get();
+            }
+            ring->in_use = true;
+        }
+
+        ~trace_ring_owner()
+        {
+            auto& registry = get_trace_registry();
+            std::lock_guard lock { registry.mutex };
+            ring->in_use = false;
+        }
+    };
+
+    inline trace_ring_owner& get_trace_owner()
+    {
+        thread_local trace_ring_owner owner;
+        return owner;
+    }
+
+    /// <summary>
+    /// Records a span, in tsc_clock ticks, on this thread's ring.
+    /// </summary>
+    inline void trace(const char* name, uint64_t begin, uint64_t end, uint64_t bytes)
+    {
+        auto& owner = get_trace_owner();
+        auto& ring = *owner.ring;
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        auto& slot = ring.slots[head % trace_ring::capacity];
+
+        slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.begin.store(begin, std::memory_order_relaxed);
+        slot.end.store(end, std::memory_order_relaxed);
+        slot.bytes.store((uint32_t)bytes, std::memory_order_relaxed);
+        slot.thread_id.store(owner.thread_id, std::memory_order_relaxed);
+        slot.sequence.store(2 * head + 2, std::memory_order_release);
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    /// <summary>
+    /// Copies the event with the given index out of a ring. Returns false if
+    /// it has been, or is being, overwritten.
+    /// </summary>
+    inline bool read_trace_event(const trace_ring& ring, uint64_t index, trace_event& event)
+    {
+        const auto& slot = ring.slots[index % trace_ring::capacity];
+        uint64_t sequence = 2 * index + 2;
+        if (slot.sequence.load(std::memory_order_acquire) != sequence)
+            return false;
+
+        event.name = slot.name.load(std::memory_order_relaxed);
+        event.begin = slot.begin.load(std::memory_order_relaxed);
+        event.end = slot.end.load(std::memory_order_relaxed);
+        event.bytes = slot.bytes.load(std::memory_order_relaxed);
+        event.thread_id = slot.thread_id.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == sequence;
+    }
+}
+
+/// <summary>
+/// Optional tracing of where each message's latency goes. While enabled,
+/// sender::send records how long it spent before writing ("enqueue") and
+/// writing ("write"), and the receiver records the time from the write to
+/// the message being read ("transit", kernel and wakeup together), before
+/// the callback ("dispatch"), and in the callback ("callback"). Spans go into
+/// a lock-free ring per thread, and can be exported for chrome://tracing or
+/// Perfetto.
+/// <para/>
+/// Note: both ends have to be tracing for transit to be recorded.
+/// </summary>
+class tracing {
+public:
+    static void enable(bool enabled = true)
+    {
+        details::get_trace_registry().enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    static bool enabled()
+    {
+        return details::tracing_enabled();
+    }
+
+    /// <summary>
+    /// Every span recorded so far by this process, in Chrome's trace event
+    /// JSON format. Doesn't stop threads from tracing in the meantime.
+    /// </summary>
+    static std::string export_chrome_json()
+    {
+        auto& registry = details::get_trace_registry();
+        std::vector<std::shared_ptr<details::trace_ring>> rings;
+        {
+            std::lock_guard lock { registry.mutex };
+            rings = registry.rings;
+        }
+
+        std::string pid = std::to_string(GetCurrentProcessId());
+        std::string json = "{\"traceEvents\":[";
+        bool first = true;
+
+        for (auto& ring : rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t tail = head > details::trace_ring::capacity ? head - details::trace_ring::capacity : 0;
+
+            // Events the thread overwrites while they're being copied are
+            // skipped.
+            details::trace_event event {};
+            for (uint64_t i = tail; i < head; i++) {
+                if (!details::read_trace_event(*ring, i, event))
+                    continue;
+
+                double begin = (double)tsc_clock::to_nanoseconds(event.begin) / 1000.0;
+                uint64_t ticks = event.end > event.begin ? event.end - event.begin : 0;
+                double duration = (double)tsc_clock::to_nanoseconds(ticks) / 1000.0;
+
+                json += first ? "\n" : ",\n";
+                first = false;
+                json += "{\"name\":\"";
+                json += event.name;
+                json += "\",\"ph\":\"X\",\"pid\":";
+                json += pid;
+                json += ",\"tid\":";
+                json += std::to_string(event.thread_id);
+                json += ",\"ts\":";
+                json += std::to_string(begin);
+                json += ",\"dur\":";
+                json += std::to_string(duration);
+                json += ",\"args\":{\"bytes\":";
+                json += std::to_string(event.bytes);
+                json += "}}";
+            }
+        }
+
+        json += "\n]}\n";
+        return json;
+    }
+};
+
+// ----------------------------------------------------------------------[ stats
+
+enum class channel_kind : uint32_t {
+    receiver = 1,
+    sender = 2,
+};
+
+/// <summary>
+/// A copy of one channel's counters, as returned by stats::read.
+/// </summary>
+struct channel_snapshot {
+    DWORD pid;
+    uint32_t id;
+    channel_kind kind;
+    std::string name;
+    uint64_t messages;
+    uint64_t bytes;
+    // Bytes waiting in the pipe, sampled every so often (receivers only).
+    uint64_t queue_depth;
+    // GetTickCount64() at the last message.
+    uint64_t last_activity;
+    // Connections accepted (receivers) or made after the first (senders).
+    uint64_t reconnects;
+    // How long callbacks (receivers) or sends (senders) took, bucketed by
+    // latency_bucket_bounds.
+    std::array<uint64_t, 10> latency;
+    uint64_t latency_sum_ns;
+};
+
+namespace details {
+    inline constexpr uint32_t stats_magic = 0x57505354;
+    inline constexpr uint32_t stats_capacity = 256;
+    inline constexpr size_t latency_buckets = std::tuple_size_v<decltype(channel_snapshot::latency)>;
+
+    /// <summary>
+    /// Upper bounds of the latency buckets in nanoseconds, from 1us up by
+    /// factors of 4. The last bucket has no bound.
+    /// </summary>
+    static inline uint64_t latency_bucket_bound(size_t bucket)
+    {
+        return 1000ull << (2 * bucket);
+    }
+
+    /// <summary>
+    /// One channel's counters in the process's stats registry. Each is only
+    /// ever written by one thread at a time, so updates are plain relaxed
+    /// loads and stores, not read-modify-writes.
+    /// </summary>
+    struct channel_stats {
+        std::atomic<uint32_t> in_use;
+        channel_kind kind;
+        char name[64];
+        std::atomic<uint64_t> messages;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> queue_depth;
+        std::atomic<uint64_t> last_activity;
+        std::atomic<uint64_t> reconnects;
+        std::atomic<uint64_t> latency[latency_buckets];
+        std::atomic<uint64_t> latency_sum_ns;
+    };
+
+    struct stats_header {
+        uint32_t magic;
+        uint32_t capacity;
+        DWORD pid;
+        // Channels that found the registry full, and so aren't in it.
+        std::atomic<uint32_t> dropped;
+        // Followed by capacity channel_stats.
+    };
+
+    static inline std::string format_stats_name(DWORD pid)
+    {
+        return format_object_name("stats", std::to_string(pid));
+    }
+
+    /// <summary>
+    /// This process's registry, created on first use. Null if it couldn't
+    /// be created, in which case nothing gets registered. Not static, so
+    /// that every translation unit shares the one registry.
+    /// </summary>
+    inline stats_header* get_stats_registry()
+    {
+        static stats_header* registry = [] () -> stats_header* {
+            DWORD pid = GetCurrentProcessId();
+            size_t size = sizeof(stats_header) + stats_capacity * sizeof(channel_stats);
+
+            // Left open for the life of the process.
+            HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                0, (DWORD)size, format_stats_name(pid).c_str());
+            bool existed = mapping && GetLastError() == ERROR_ALREADY_EXISTS;
+            void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+            if (!view)
+                return nullptr;
+
+            // One that already exists may be in use by another module of
+            // this process, so it's joined as is rather than cleared. (A new
+            // mapping starts out zeroed.)
+            auto* header = reinterpret_cast<stats_header*>(view);
+            if (existed)
+                return header;
+
+            header->capacity = stats_capacity;
+            header->pid = pid;
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = stats_magic;
+            return header;
+        }();
+        return registry;
+    }
+
+    static inline channel_stats* stats_entries(stats_header* header)
+    {
+        return reinterpret_cast<channel_stats*>(header + 1);
+    }
+
+    struct stats_deleter {
+        void operator()(channel_stats* stats)
+        {
+            stats->in_use.store(0, std::memory_order_release);
+        }
+    };
+
+    using unique_stats = std::unique_ptr<channel_stats, stats_deleter>;
+
+    inline unique_stats register_channel(channel_kind kind, std::string_view name)
+    {
+        auto* header = get_stats_registry();
+        if (!header)
+            return nullptr;
+
+        auto* entries = stats_entries(header);
+        for (uint32_t i = 0; i < header->capacity; i++) {
+            uint32_t in_use = 0;
+            if (!entries[i].in_use.compare_exchange_strong(in_use, 2))
+                continue;
+
+            auto& stats = entries[i];
+            stats.kind = kind;
+            size_t length = std::min<size_t>(name.size(), sizeof(stats.name) - 1);
+            std::memcpy(stats.name, name.data(), length);
+            stats.name[length] = '\0';
+            stats.messages.store(0, std::memory_order_relaxed);
+            stats.bytes.store(0, std::memory_order_relaxed);
+            stats.queue_depth.store(0, std::memory_order_relaxed);
+            stats.last_activity.store(GetTickCount64(), std::memory_order_relaxed);
+            stats.reconnects.store(0, std::memory_order_relaxed);
+            for (auto& bucket : stats.latency)
+                bucket.store(0, std::memory_order_relaxed);
+            stats.latency_sum_ns.store(0, std::memory_order_relaxed);
+
+            // 2 while being set up, so readers skip it until now.
+            stats.in_use.store(1, std::memory_order_release);
+            return unique_stats { &stats };
+        }
+
+        header->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    static inline void bump(std::atomic<uint64_t>& counter, uint64_t amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// ticks is how long the message took to handle, in tsc_clock ticks.
+    /// </summary>
+    static inline void count_message(channel_stats* stats, size_t bytes, uint64_t ticks)
+    {
+        if (!stats)
+            return;
+
+        bump(stats->messages, 1);
+        bump(stats->bytes, bytes);
+        stats->last_activity.store(GetTickCount64(), std::memory_order_relaxed);
+
+        uint64_t nanoseconds = tsc_clock::to_nanoseconds(ticks);
+        size_t bucket = 0;
+        while (bucket < latency_buckets - 1 && nanoseconds > latency_bucket_bound(bucket))
+            bucket++;
+        bump(stats->latency[bucket], 1);
+        bump(stats->latency_sum_ns, nanoseconds);
+    }
+}
+
+/// <summary>
+/// Every receiver and sender publishes its counters in a small registry in
+/// shared memory, one per process, so they can be inspected from outside
+/// (see win-pipe-stat.cpp) without attaching a debugger. Publishing costs a
+/// few relaxed stores per message.
+/// </summary>
+class stats {
+public:
+    /// <summary>
+    /// Copies the counters of every channel in the given process. Returns
+    /// nothing if the process doesn't exist or has no channels.
+    /// </summary>
+    static std::vector<channel_snapshot> read(DWORD pid = GetCurrentProcessId())
+    {
+        std::vector<channel_snapshot> snapshots;
+
+        details::unique_handle mapping;
+        details::unique_view view;
+        auto* header = open(pid, mapping, view);
+        if (!header)
+            return snapshots;
+
+        auto* entries = details::stats_entries(header);
+        for (uint32_t i = 0; i < std::min<uint32_t>(header->capacity, details::stats_capacity); i++) {
+            auto& stats = entries[i];
+            if (stats.in_use.load(std::memory_order_acquire) != 1)
+                continue;
+
+            channel_snapshot snapshot {};
+            snapshot.pid = pid;
+            snapshot.id = i;
+            snapshot.kind = stats.kind;
+            snapshot.name.assign(stats.name, strnlen(stats.name, sizeof(stats.name)));
+            snapshot.messages = stats.messages.load(std::memory_order_relaxed);
+            snapshot.bytes = stats.bytes.load(std::memory_order_relaxed);
+            snapshot.queue_depth = stats.queue_depth.load(std::memory_order_relaxed);
+            snapshot.last_activity = stats.last_activity.load(std::memory_order_relaxed);
+            snapshot.reconnects = stats.reconnects.load(std::memory_order_relaxed);
+            for (size_t j = 0; j < details::latency_buckets; j++)
+                snapshot.latency[j] = stats.latency[j].load(std::memory_order_relaxed);
+            snapshot.latency_sum_ns = stats.latency_sum_ns.load(std::memory_order_relaxed);
+            snapshots.push_back(std::move(snapshot));
+        }
+
+        return snapshots;
+    }
+
+    /// <summary>
+    /// How many channels in the given process found the registry full, and
+    /// so are missing from read().
+    /// </summary>
+    static uint32_t dropped(DWORD pid = GetCurrentProcessId())
+    {
+        details::unique_handle mapping;
+        details::unique_view view;
+        auto* header = open(pid, mapping, view);
+        return header ? header->dropped.load(std::memory_order_relaxed) : 0;
+    }
+
+    /// <summary>
+    /// Every channel's counters in the given process, in OpenMetrics text
+    /// format, ready to be scraped by Prometheus. Only reads the registry,
+    /// so the I/O threads never wait on it.
+    /// </summary>
+    static std::string export_openmetrics(DWORD pid = GetCurrentProcessId())
+    {
+        auto snapshots = read(pid);
+        ULONGLONG now = GetTickCount64();
+        std::string text;
+
+        // The registry slot tells apart channels of the same kind and name
+        // in one process, which would otherwise be duplicate series.
+        auto labels = [&] (const channel_snapshot& snapshot) {
+            std::string label = "{pid=\"" + std::to_string(snapshot.pid)
+                + "\",id=\"" + std::to_string(snapshot.id) + "\",kind=\"";
+            label += snapshot.kind == channel_kind::receiver ? "receiver" : "sender";
+            label += "\",channel=\"";
+            for (char c : snapshot.name) {
+                if (c == '\\' || c == '"')
+                    label += '\\';
+                if (c == '\n')
+                    label += "\\n";
+                else
+                    label += c;
+            }
+            label += "\"";
+            return label;
+        };
+
+        auto family = [&] (const char* name, const char* type, const char* help,
+                          const char* suffix, auto value) {
+            text += "# TYPE win_pipe_";
+            text += name;
+            text += " ";
+            text += type;
+            text += "\n# HELP win_pipe_";
+            text += name;
+            text += " ";
+            text += help;
+            text += "\n";
+            for (auto& snapshot : snapshots) {
+                text += "win_pipe_";
+                text += name;
+                text += suffix;
+                text += labels(snapshot);
+                text += "} ";
+                text += value(snapshot);
+                text += "\n";
+            }
+        };
+
+        family("messages", "counter", "Messages sent or passed to the callback.", "_total",
+            [] (auto& snapshot) { return std::to_string(snapshot.messages); });
+        family("bytes", "counter", "Payload bytes sent or passed to the callback.", "_total",
+            [] (auto& snapshot) { return std::to_string(snapshot.bytes); });
+        family("reconnects", "counter", "Connections accepted or remade.", "_total",
+            [] (auto& snapshot) { return std::to_string(snapshot.reconnects); });
+        family("queued_bytes", "gauge", "Bytes waiting in the pipe.", "",
+            [] (auto& snapshot) { return std::to_string(snapshot.queue_depth); });
+        family("idle_seconds", "gauge", "Time since the last message.", "",
+            [&] (auto& snapshot) {
+                ULONGLONG idle = now > snapshot.last_activity ? now - snapshot.last_activity : 0;
+                return std::to_string(idle / 1000.0);
+            });
+
+        text += "# TYPE win_pipe_latency_seconds histogram\n"
+                "# HELP win_pipe_latency_seconds Time spent in callbacks or sends.\n";
+        for (auto& snapshot : snapshots) {
+            std::string label = labels(snapshot);
+            uint64_t count = 0;
+            for (size_t i = 0; i < details::latency_buckets; i++) {
+                count += snapshot.latency[i];
+                text += "win_pipe_latency_seconds_bucket" + label + ",le=\"";
+                text += i < details::latency_buckets - 1
+                    ? std::to_string(details::latency_bucket_bound(i) / 1e9)
+                    : "+Inf";
+                text += "\"} " + std::to_string(count) + "\n";
+            }
+            text += "win_pipe_latency_seconds_count" + label + "} " + std::to_string(count) + "\n";
+            text += "win_pipe_latency_seconds_sum" + label + "} "
+                + std::to_string(snapshot.latency_sum_ns / 1e9) + "\n";
+        }
+
+        text += "# EOF\n";
+        return text;
+    }
+
+private:
+    static details::stats_header* open(DWORD pid, details::unique_handle& mapping,
+        details::unique_view& view)
+    {
+        mapping.reset(OpenFileMappingA(FILE_MAP_READ, FALSE, details::format_stats_name(pid).c_str()));
+        if (!mapping)
+            return nullptr;
+
+        view.reset(MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0));
+        if (!view)
+            return nullptr;
+
+        auto* header = reinterpret_cast<details::stats_header*>(view.get());
+        if (header->magic != details::stats_magic)
+            return nullptr;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header;
+    }
+};
+
+#ifdef WIN_PIPE_ENABLE_METRICS_SERVER
+/// <summary>
+/// A tiny HTTP server on 127.0.0.1 answering every request with
+/// stats::export_openmetrics, for Prometheus to scrape. Requests are served
+/// one at a time on the server's own thread. Only available with
+/// WIN_PIPE_ENABLE_METRICS_SERVER defined before including win-pipe.h.
+/// </summary>
+class metrics_server {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No socket is opened, and no thread
+    /// is started.
+    /// </summary>
+    metrics_server() = default;
+
+    /// <summary>
+    /// Throws if the port can't be listened on.
+    /// </summary>
+    explicit metrics_server(uint16_t port)
+    {
+        m_param = std::make_unique<thread_param>();
+
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+            m_param = nullptr;
+            throw std::runtime_error("WSAStartup failed");
+        }
+        m_param->started = true;
+
+        m_param->listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in address {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (m_param->listener == INVALID_SOCKET
+            || bind(m_param->listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(m_param->listener, SOMAXCONN) != 0) {
+            m_param = nullptr;
+            throw std::runtime_error("Failed to listen on metrics port " + std::to_string(port));
+        }
+
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    metrics_server(metrics_server&&) noexcept = default;
+
+    ~metrics_server()
+    {
+        stop_thread();
+    }
+
+    metrics_server& operator=(metrics_server&& other) noexcept
+    {
+        if (this != &other) {
+            stop_thread();
+            m_param = std::move(other.m_param);
+            m_thread = std::move(other.m_thread);
+        }
+        return *this;
+    }
+
+private:
+    struct thread_param;
+
+    void stop_thread()
+    {
+        if (!m_thread)
+            return;
+
+        // Closing the socket is what gets accept to return.
+        closesocket(m_param->listener);
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_param->listener = INVALID_SOCKET;
+        m_thread = nullptr;
+    }
+
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+
+        while (true) {
+            SOCKET client = accept(param->listener, NULL, NULL);
+            if (client == INVALID_SOCKET)
+                break;
+
+            // Don't let a client that never sends its request hold up the rest.
+            DWORD timeout = 1000;
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO,
+                reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+            serve(client);
+            closesocket(client);
+        }
+
+        return TRUE;
+    }
+
+    static void serve(SOCKET client)
+    {
+        // Only the request line matters, and nothing is served but metrics.
+        char request[1024];
+        int received = recv(client, request, sizeof(request), 0);
+        if (received <= 0)
+            return;
+
+        std::string body = stats::export_openmetrics();
+        std::string response = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                               "Connection: close\r\n"
+                               "Content-Length: "
+            + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            int result = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+            if (result <= 0)
+                return;
+            sent += result;
+        }
+    }
+
+    struct thread_param {
+        SOCKET listener = INVALID_SOCKET;
+        bool started = false;
+
+        ~thread_param()
+        {
+            if (listener != INVALID_SOCKET)
+                closesocket(listener);
+            if (started)
+                WSACleanup();
+        }
+    };
+
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+#endif
+
+// -------------------------------------------------------------------[ watchdog
+
+/// <summary>
+/// Describes a callback that took too long, for receiver::set_callback_limits.
+/// </summary>
+struct callback_report {
+    std::string_view channel;
+    std::chrono::nanoseconds duration;
+    // Size of the message being handled.
+    size_t size;
+    // True if the callback hasn't returned yet, and the report comes from
+    // the watchdog thread rather than the read thread.
+    bool stuck;
+};
+
+using diagnostics_t = std::function<void(const callback_report&)>;
+
+namespace details {
+    /// <summary>
+    /// What the watchdog knows about one receiver's callback. started_at is
+    /// the tsc_clock time the running callback started, or 0 between
+    /// callbacks.
+    /// </summary>
+    struct callback_monitor {
+        std::string channel;
+        std::chrono::nanoseconds slow;
+        std::chrono::nanoseconds stuck;
+        diagnostics_t diagnostics;
+        std::atomic<uint64_t> started_at { 0 };
+        std::atomic<size_t> size { 0 };
+        // Only touched by the watchdog thread.
+        uint64_t reported_for = 0;
+
+        void begin(uint64_t now, size_t message_size)
+        {
+            size.store(message_size, std::memory_order_relaxed);
+            started_at.store(now, std::memory_order_release);
+        }
+
+        /// <summary>
+        /// Returns whether the callback was slow, in which case the caller
+        /// report()s it once it no longer holds the callback lock.
+        /// </summary>
+        bool end(uint64_t ticks)
+        {
+            started_at.store(0, std::memory_order_relaxed);
+            return slow.count() > 0 && std::chrono::nanoseconds { tsc_clock::to_nanoseconds(ticks) } > slow;
+        }
+
+        void report(uint64_t ticks, size_t message_size)
+        {
+            auto duration = std::chrono::nanoseconds { tsc_clock::to_nanoseconds(ticks) };
+            diagnostics(callback_report { channel, duration, message_size, false });
+        }
+    };
+
+    /// <summary>
+    /// One thread per process checks every monitored callback a few times
+    /// per stuck limit. It's only started once a receiver asks for it, and
+    /// costs the read threads nothing beyond the two stores in begin/end.
+    /// </summary>
+    struct watchdog {
+        std::mutex mutex;
+        std::vector<std::weak_ptr<callback_monitor>> monitors;
+        std::chrono::nanoseconds interval { std::chrono::milliseconds { 100 } };
+        unique_handle event;
+        unique_handle thread;
+
+        ~watchdog()
+        {
+            if (!thread)
+                return;
+
+            SetEvent(event.get());
+            WaitForSingleObject(thread.get(), INFINITE);
+        }
+
+        void watch(const std::shared_ptr<callback_monitor>& monitor)
+        {
+            std::lock_guard lock { mutex };
+            monitors.push_back(monitor);
+            interval = std::min<std::chrono::nanoseconds>(interval, monitor->stuck / 4);
+
+            if (!thread) {
+                event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+                thread.reset(CreateThread(NULL, 0, run, this, 0, NULL));
+            }
+        }
+
+        static DWORD WINAPI run(LPVOID lp)
+        {
+            auto* self = reinterpret_cast<watchdog*>(lp);
+            std::vector<std::shared_ptr<callback_monitor>> stuck;
+
+            while (true) {
+                DWORD timeout;
+                {
+                    std::lock_guard lock { self->mutex };
+                    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(self->interval);
+                    timeout = (DWORD)std::max<int64_t>(ms.count(), 1);
+                }
+
+                if (WaitForSingleObject(self->event.get(), timeout) != WAIT_TIMEOUT)
+                    break;
+
+                self->check(stuck);
+
+                // Outside the lock, so that a diagnostics hook can set limits.
+                for (auto& monitor : stuck) {
+                    uint64_t started_at = monitor->reported_for;
+                    uint64_t now = tsc_clock::now();
+                    auto duration = std::chrono::nanoseconds {
+                        tsc_clock::to_nanoseconds(now > started_at ? now - started_at : 0)
+                    };
+                    monitor->diagnostics(callback_report { monitor->channel, duration,
+                        monitor->size.load(std::memory_order_relaxed), true });
+                }
+                stuck.clear();
+            }
+
+            return TRUE;
+        }
+
+        void check(std::vector<std::shared_ptr<callback_monitor>>& stuck)
+        {
+            std::lock_guard lock { mutex };
+            uint64_t now = tsc_clock::now();
+
+            for (size_t i = 0; i < monitors.size();) {
+                auto monitor = monitors[i].lock();
+                if (!monitor) {
+                    monitors[i] = std::move(monitors.back());
+                    monitors.pop_back();
+                    continue;
+                }
+                i++;
+
+                // Each callback is reported at most once, however long it runs.
+                uint64_t started_at = monitor->started_at.load(std::memory_order_acquire);
+                if (started_at == 0 || started_at == monitor->reported_for || now < started_at)
+                    continue;
+
+                if (std::chrono::nanoseconds { tsc_clock::to_nanoseconds(now - started_at) } > monitor->stuck) {
+                    monitor->reported_for = started_at;
+                    stuck.push_back(std::move(monitor));
+                }
+            }
+        }
+    };
+
+    // Not static, so that there's one watchdog thread per process rather
+    // than per translation unit.
+    inline watchdog& get_watchdog()
+    {
+        static watchdog instance;
+        return instance;
+    }
+}
+
+// ---------------------------------------------------------------------[ faults
+
+// Fault injection, for measuring how long recovery takes and how much is
+// lost on the way. Define WIN_PIPE_ENABLE_FAULT_INJECTION before including
+// win-pipe.h to get fault_injector and the set_fault_injector methods.
+// Without it, none of this exists and channels pay nothing for it.
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+enum class fault : uint32_t {
+    none,
+    // The channel drops its connection. A receiver loses the message it
+    // just read; a sender reconnects before writing.
+    disconnect,
+    // Only the first half of the message gets through.
+    partial_write,
+    // The channel stalls for fault_injector::delay before carrying on.
+    delay,
+    // The message is padded out by fault_injector::oversize bytes. Only
+    // applies to senders.
+    oversize,
+};
+
+/// <summary>
+/// Decides which messages get which faults, from a schedule set up with
+/// every() before attaching it to a channel. Counts messages on its own, so
+/// one injector shared by several channels sees all their messages as one
+/// stream.
+/// </summary>
+class fault_injector {
+public:
+    /// <summary>
+    /// Injects kind into message offset, and every nth message after it. If
+    /// several rules hit the same message, the first one added wins.
+    /// </summary>
+    fault_injector& every(uint64_t n, fault kind, uint64_t offset = 0)
+    {
+        m_rules.push_back(rule { std::max<uint64_t>(n, 1), offset, kind });
+        return *this;
+    }
+
+    fault_injector& set_delay(std::chrono::milliseconds delay)
+    {
+        m_delay = delay;
+        return *this;
+    }
+
+    fault_injector& set_oversize(size_t bytes)
+    {
+        m_oversize = bytes;
+        return *this;
+    }
+
+    /// <summary>
+    /// The fault for the next message. Called by the channel once per
+    /// message.
+    /// </summary>
+    fault next()
+    {
+        uint64_t message = m_messages.fetch_add(1, std::memory_order_relaxed);
+        for (const auto& rule : m_rules) {
+            if (message < rule.offset || (message - rule.offset) % rule.every != 0)
+                continue;
+
+            m_injected[(size_t)rule.kind].fetch_add(1, std::memory_order_relaxed);
+            m_last_injected_at.store(tsc_clock::now(), std::memory_order_release);
+            return rule.kind;
+        }
+        return fault::none;
+    }
+
+    std::chrono::milliseconds delay() const
+    {
+        return m_delay;
+    }
+
+    size_t oversize() const
+    {
+        return m_oversize;
+    }
+
+    uint64_t injected(fault kind) const
+    {
+        return m_injected[(size_t)kind].load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Total number of faults injected so far.
+    /// </summary>
+    uint64_t injected() const
+    {
+        uint64_t total = 0;
+        for (size_t i = 1; i < m_injected.size(); i++)
+            total += m_injected[i].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    /// <summary>
+    /// tsc_clock time of the latest fault, or 0 if there hasn't been one.
+    /// </summary>
+    uint64_t last_injected_at() const
+    {
+        return m_last_injected_at.load(std::memory_order_acquire);
+    }
+
+private:
+    struct rule {
+        uint64_t every;
+        uint64_t offset;
+        fault kind;
+    };
+
+    std::vector<rule> m_rules;
+    std::chrono::milliseconds m_delay { 10 };
+    size_t m_oversize = 1024 * 1024;
+    std::atomic<uint64_t> m_messages { 0 };
+    std::array<std::atomic<uint64_t>, 5> m_injected {};
+    std::atomic<uint64_t> m_last_injected_at { 0 };
+};
+#endif
+
+// -------------------------------------------------------------------[ receiver
+
+class receiver {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No pipe is opened/created, and no
+    /// read thread is started.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    receiver() = default;
+
+    receiver(std::string_view name, callback_t callback, start_mode mode = start_mode::eager)
+    {
+        create(name);
+        start(callback, mode);
+    }
+
+    /// <summary>
+    /// Same as above, except that the callback is also told which sender
+    /// each message came from.
+    /// </summary>
+    receiver(std::string_view name, with_info_t, extended_callback_t callback,
+        start_mode mode = start_mode::eager)
+    {
+        create(name);
+        m_param->extended_callback = callback;
+        start(nullptr, mode);
+    }
+
+    /// <summary>
+    /// Creates a receiver for each name, all with the same callback, for
+    /// opening many channels at startup. Read threads start lazily, so this
+    /// costs little more than creating the pipes. Throws if any of them
+    /// can't be created, after closing those that were.
+    /// </summary>
+    template <typename Names>
+    static std::vector<receiver> open(const Names& names, callback_t callback)
+    {
+        std::vector<receiver> receivers;
+        receivers.reserve(std::size(names));
+        for (const auto& name : names)
+            receivers.emplace_back(std::string_view { name }, callback, start_mode::lazy);
+        return receivers;
+    }
+
+    /// <summary>
+    /// Takes over a pipe from a receiver in another process that is currently
+    /// in hand_over(). Senders stay connected throughout and don't notice the
+    /// switch; anything they sent that the old receiver hadn't gotten to yet
+    /// is received here instead. Meant for restarting/upgrading a consumer
+    /// without losing messages.
+    /// <para/>
+    /// Throws if no receiver hands over the pipe within the timeout. Only
+    /// receivers running as the same user hand over to each other.
+    /// </summary>
+    static receiver take_over(std::string_view name, callback_t callback,
+        std::chrono::milliseconds timeout)
+    {
+        receiver adopted = adopt(name, timeout);
+        adopted.start(callback);
+        return adopted;
+    }
+
+    /// <summary>
+    /// Same as above, except that the callback is also told which sender
+    /// each message came from.
+    /// </summary>
+    static receiver take_over(std::string_view name, with_info_t, extended_callback_t callback,
+        std::chrono::milliseconds timeout)
+    {
+        receiver adopted = adopt(name, timeout);
+        adopted.m_param->extended_callback = callback;
+        adopted.start(nullptr);
+        return adopted;
+    }
+
+    receiver(receiver&&) noexcept = default;
+
+    ~receiver()
+    {
+        settle(true);
+        if (m_param)
+            SetEvent(m_param->event.get());
+
+        WaitForSingleObject(m_thread.get(), INFINITE);
+    }
+
+    receiver& operator=(receiver&&) noexcept = default;
+
+    void set_callback(callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->callback = callback;
+        m_param->extended_callback = nullptr;
+    }
+
+    void set_extended_callback(extended_callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->extended_callback = callback;
+        m_param->callback = nullptr;
+    }
+
+    /// <summary>
+    /// Calls diagnostics, on the read thread, after every callback that took
+    /// longer than slow. If stuck is nonzero, a watchdog thread also calls
+    /// it, once, for any callback that still hasn't returned after stuck, so
+    /// that a hung callback shows up before the sender times out. The hook
+    /// must be thread-safe if both are used. Zero disables either check;
+    /// passing an empty hook disables both.
+    /// </summary>
+    void set_callback_limits(std::chrono::microseconds slow, std::chrono::milliseconds stuck,
+        diagnostics_t diagnostics)
+    {
+        if (!m_param)
+            return;
+
+        std::shared_ptr<details::callback_monitor> monitor;
+        if (diagnostics && (slow.count() > 0 || stuck.count() > 0)) {
+            monitor = std::make_shared<details::callback_monitor>();
+            monitor->channel = m_param->name;
+            monitor->slow = slow;
+            monitor->stuck = stuck;
+            monitor->diagnostics = diagnostics;
+            if (stuck.count() > 0)
+                details::get_watchdog().watch(monitor);
+        }
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->monitor = std::move(monitor);
+    }
+
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+    /// <summary>
+    /// Injects faults into received messages, right after they're read. Pass
+    /// nullptr to stop.
+    /// </summary>
+    void set_fault_injector(std::shared_ptr<fault_injector> faults)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->faults = std::move(faults);
+    }
+#endif
+
+    /// <summary>
+    /// If nothing, not even a heartbeat, arrives from the connected sender
+    /// within the timeout, the sender is assumed dead and the pipe is
+    /// disconnected so that another sender can connect. Should be a few times
+    /// larger than the sender's heartbeat interval. Zero (the default)
+    /// disables the timeout.
+    /// </summary>
+    void set_liveness_timeout(std::chrono::milliseconds timeout)
+    {
+        if (!m_param)
+            return;
+
+        m_param->liveness_timeout.store(
+            timeout.count() > 0 ? (DWORD)timeout.count() : INFINITE,
+            std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Number of messages that were skipped without invoking the callback
+    /// because their deadline had already passed by the time they were read.
+    /// </summary>
+    uint64_t expired_count() const
+    {
+        if (!m_param)
+            return 0;
+
+        return m_param->expired_count.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Only lets through messages sent without a topic, or with one of these.
+    /// The connected sender is told, and from then on doesn't even write the
+    /// rest to the pipe. Empty (the default) lets everything through.
+    /// <para/>
+    /// Note: topics are told apart by a 32-bit hash, so there's a slim chance
+    /// of an unwanted topic getting through along with a wanted one.
+    /// </summary>
+    void set_topics(const std::vector<std::string_view>& topics)
+    {
+        if (!m_param)
+            return;
+
+        std::vector<uint32_t> ids;
+        for (auto topic : topics)
+            ids.push_back(details::topic_id(topic));
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        {
+            std::lock_guard lock { m_param->topics_mutex };
+            m_param->topics = std::move(ids);
+        }
+        m_param->topics_version.fetch_add(1, std::memory_order_relaxed);
+        SetEvent(m_param->topics_event.get());
+    }
+
+    /// <summary>
+    /// Number of messages dropped because of their topic. Senders skip those
+    /// themselves once they know the receiver's topics, so these are only
+    /// the ones sent just before.
+    /// </summary>
+    uint64_t unwanted_count() const
+    {
+        if (!m_param)
+            return 0;
+
+        return m_param->unwanted_count.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Number of messages dropped because they had already been passed to
+    /// the callback, which happens when a sender with acknowledgements on
+    /// reconnects and resends what it hadn't seen acknowledged yet. Only
+    /// duplicates within one receiver are caught: a receiver that replaces
+    /// another gets whatever its predecessor hadn't acknowledged.
+    /// </summary>
+    uint64_t duplicate_count() const
+    {
+        if (!m_param)
+            return 0;
+
+        return m_param->duplicate_count.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Waits up to the timeout for a receiver in another process to call
+    /// take_over() with the same name, then passes the pipe on to it, along
+    /// with the message currently being read, if any. Senders stay connected
+    /// throughout. Afterwards, this receiver no longer receives anything.
+    /// <para/>
+    /// Returns false if no successor showed up in time, the one that did runs
+    /// as another user, or the handover failed, in which case this receiver
+    /// carries on receiving as normal.
+    /// </summary>
+    bool hand_over(std::chrono::milliseconds timeout)
+    {
+        settle(false);
+        if (!m_param || !m_thread)
+            return false;
+
+        // One deadline for the whole handover, not one per step.
+        ULONGLONG deadline = GetTickCount64() + (ULONGLONG)timeout.count();
+
+        std::string control_name { details::format_handover_name(m_param->name) };
+        details::unique_handle control { CreateNamedPipeA(
+            control_name.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+            1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL) };
+        if (control.get() == INVALID_HANDLE_VALUE)
+            return false;
+
+        details::unique_handle event { CreateEventA(NULL, TRUE, FALSE, NULL) };
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = event.get();
+
+        DWORD bytes = 0;
+        BOOL started = ConnectNamedPipe(control.get(), &overlapped);
+        if (started || GetLastError() != ERROR_PIPE_CONNECTED) {
+            if (!details::finish_overlapped(control.get(), overlapped, started,
+                    details::time_left(deadline), bytes))
+                return false;
+        }
+
+        DWORD pid = 0;
+        started = ReadFile(control.get(), &pid, sizeof(pid), NULL, &overlapped);
+        if (!details::finish_overlapped(control.get(), overlapped, started,
+                details::time_left(deadline), bytes))
+            return false;
+
+        // Anyone can connect and claim any pid, so the pid is checked against
+        // the actual client, and the pipe only goes to the same user.
+        ULONG client_pid = 0;
+        if (!GetNamedPipeClientProcessId(control.get(), &client_pid) || client_pid != pid)
+            return false;
+
+        details::unique_handle successor { OpenProcess(
+            PROCESS_DUP_HANDLE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid) };
+        if (!successor || !details::same_user(successor.get()))
+            return false;
+
+        // From here on, the read thread has to be stopped, so any failure
+        // restarts it again to carry on as if nothing happened.
+        m_param->handing_over.store(true, std::memory_order_relaxed);
+        SetEvent(m_param->event.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_thread = nullptr;
+        m_param->handing_over.store(false, std::memory_order_relaxed);
+
+        HANDLE remote_pipe = NULL;
+        bool success = DuplicateHandle(GetCurrentProcess(), m_param->pipe.get(),
+            successor.get(), &remote_pipe, 0, FALSE, DUPLICATE_SAME_ACCESS);
+
+        details::handover_header header {};
+        header.pipe = (uint64_t)(uintptr_t)remote_pipe;
+        header.leftover_size = (uint32_t)m_param->leftover.size();
+
+        if (success) {
+            started = WriteFile(control.get(), &header, sizeof(header), NULL, &overlapped);
+            success = details::finish_overlapped(control.get(), overlapped, started,
+                details::time_left(deadline), bytes);
+        }
+        if (success && header.leftover_size > 0) {
+            started = WriteFile(control.get(), m_param->leftover.data(),
+                header.leftover_size, NULL, &overlapped);
+            success = details::finish_overlapped(control.get(), overlapped, started,
+                details::time_left(deadline), bytes);
+        }
+
+        if (!success) {
+            ResetEvent(m_param->event.get());
+            start(m_param->callback);
+            return false;
+        }
+
+        // Closing our handle doesn't disconnect the sender, since the
+        // successor holds another handle to the same pipe instance.
+        FlushFileBuffers(control.get());
+        m_param->pipe = nullptr;
+        return true;
+    }
+
+    /// <summary>
+    /// Gracefully shuts down the receiver. New senders are no longer accepted,
+    /// but every message already in the pipe is still passed to the callback
+    /// before the read thread exits. If that takes longer than the timeout,
+    /// whatever is left is discarded, same as in the destructor.
+    /// <para/>
+    /// Returns the number of messages passed to the callback while draining.
+    /// Afterwards, the pipe is closed and nothing more will be received.
+    /// </summary>
+    uint64_t drain(std::chrono::milliseconds timeout)
+    {
+        settle(true);
+        if (m_param && !m_thread)
+            m_param->pipe = nullptr;
+        if (!m_param || !m_thread)
+            return 0;
+
+        m_param->draining.store(true, std::memory_order_relaxed);
+        SetEvent(m_param->event.get());
+
+        if (WaitForSingleObject(m_thread.get(), (DWORD)timeout.count()) == WAIT_TIMEOUT) {
+            m_param->draining.store(false, std::memory_order_relaxed);
+            WaitForSingleObject(m_thread.get(), INFINITE);
+        }
+
+        m_thread = nullptr;
+        m_param->pipe = nullptr;
+        return m_param->drained_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct thread_param;
+
+    void create(std::string_view name)
+    {
+        m_param = std::make_unique<thread_param>();
+        m_param->name = name;
+
+        std::string pipe_name { details::format_name(name) };
+        m_param->pipe.reset(CreateNamedPipeA(
+            pipe_name.c_str(),
+            // Duplex for telling senders about topics and acknowledgements.
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+            1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
+        if (m_param->pipe.get() == INVALID_HANDLE_VALUE) {
+            std::string msg { "Pipe creation failed: " };
+            msg += std::to_string(GetLastError());
+            throw std::runtime_error(msg);
+        }
+    }
+
+    /// <summary>
+    /// The successor's half of a handover. Returns the adopted pipe, not yet
+    /// started.
+    /// </summary>
+    static receiver adopt(std::string_view name, std::chrono::milliseconds timeout)
+    {
+        std::string control_name { details::format_handover_name(name) };
+
+        auto fail = [](const char* what) {
+            std::string msg { what };
+            msg += std::to_string(GetLastError());
+            throw std::runtime_error(msg);
+        };
+
+        // The old receiver may not have created the handover pipe yet, in
+        // which case WaitNamedPipe fails straight away instead of waiting.
+        // Zero would mean the default timeout there, hence waiting at least 1.
+        ULONGLONG deadline = GetTickCount64() + (ULONGLONG)timeout.count();
+        while (!WaitNamedPipeA(control_name.c_str(), std::max<DWORD>(details::time_left(deadline), 1))) {
+            if (GetLastError() != ERROR_FILE_NOT_FOUND || details::time_left(deadline) == 0)
+                fail("No receiver to take over from: ");
+            Sleep(10);
+        }
+
+        details::unique_handle control { CreateFileA(control_name.c_str(),
+            GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, NULL, NULL) };
+        if (control.get() == INVALID_HANDLE_VALUE)
+            fail("Handover connection failed: ");
+
+        DWORD mode = PIPE_READMODE_MESSAGE;
+        SetNamedPipeHandleState(control.get(), &mode, NULL, NULL);
+
+        DWORD pid = GetCurrentProcessId();
+        DWORD bytes = 0;
+        if (!WriteFile(control.get(), &pid, sizeof(pid), &bytes, NULL))
+            fail("Handover request failed: ");
+
+        details::handover_header header {};
+        if (!ReadFile(control.get(), &header, sizeof(header), &bytes, NULL)
+            || bytes != sizeof(header))
+            fail("Handover failed: ");
+
+        std::vector<uint8_t> leftover(header.leftover_size);
+        if (!leftover.empty()
+            && !ReadFile(control.get(), leftover.data(), (DWORD)leftover.size(), &bytes, NULL))
+            fail("Handover of leftover message failed: ");
+
+        receiver adopted;
+        adopted.m_param = std::make_unique<thread_param>();
+        adopted.m_param->name = name;
+        adopted.m_param->pipe.reset((HANDLE)(uintptr_t)header.pipe);
+        adopted.m_param->leftover = std::move(leftover);
+        return adopted;
+    }
+
+    void start(callback_t callback, start_mode mode = start_mode::eager)
+    {
+        m_param->callback = callback;
+        if (!m_param->stats)
+            m_param->stats = details::register_channel(channel_kind::receiver, m_param->name);
+        if (!m_param->event)
+            m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        if (!m_param->io_event)
+            m_param->io_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        if (!m_param->control_event)
+            m_param->control_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->control_overlapped.hEvent = m_param->control_event.get();
+        if (!m_param->topics_event)
+            m_param->topics_event.reset(CreateEventA(NULL, FALSE, FALSE, NULL));
+
+        // A message left over from a handover comes before anything still in
+        // the pipe.
+        if (!m_param->leftover.empty()) {
+            dispatch(m_param.get(), m_param->leftover.data(),
+                (DWORD)m_param->leftover.size(), 0);
+            m_param->leftover.clear();
+        }
+
+        if (mode == start_mode::lazy && start_lazily())
+            return;
+
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    /// <summary>
+    /// Starts connecting without a thread, and has the thread pool start
+    /// the read thread once a sender connects. Returns false if the caller
+    /// should start it right away instead, e.g. because a sender is already
+    /// there, in which case the thread's own connect picks that up.
+    /// </summary>
+    bool start_lazily()
+    {
+        auto* param = m_param.get();
+        param->first_connect = {};
+        param->first_connect.hEvent = param->io_event.get();
+
+        if (ConnectNamedPipe(param->pipe.get(), &param->first_connect)
+            || GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        // From here on, the read thread has to take over the pending connect.
+        param->adopt_connect = true;
+        return RegisterWaitForSingleObject(&param->start_wait, param->io_event.get(),
+            on_first_connect, param, INFINITE, WT_EXECUTEONLYONCE);
+    }
+
+    static void CALLBACK on_first_connect(PVOID context, BOOLEAN)
+    {
+        auto* param = reinterpret_cast<thread_param*>(context);
+        param->lazy_thread.reset(CreateThread(NULL, 0, thread, param, 0, NULL));
+    }
+
+    /// <summary>
+    /// Makes sure a lazily started receiver's read thread, if any, is in
+    /// m_thread. If no sender has connected yet, either starts the thread
+    /// anyway, or with cancel set, cancels the pending connect and leaves
+    /// the receiver without a thread.
+    /// </summary>
+    void settle(bool cancel)
+    {
+        if (!m_param || !m_param->start_wait)
+            return;
+
+        // Also waits for on_first_connect, if it's already running.
+        UnregisterWaitEx(m_param->start_wait, INVALID_HANDLE_VALUE);
+        m_param->start_wait = NULL;
+
+        if (m_param->lazy_thread) {
+            m_thread = std::move(m_param->lazy_thread);
+            return;
+        }
+
+        if (!cancel) {
+            m_thread.reset(CreateThread(NULL, 0, thread, m_param.get(), 0, NULL));
+            return;
+        }
+
+        DWORD unused = 0;
+        CancelIoEx(m_param->pipe.get(), &m_param->first_connect);
+        GetOverlappedResult(m_param->pipe.get(), &m_param->first_connect, &unused, TRUE);
+        m_param->adopt_connect = false;
+    }
+
+    enum class io_result {
+        ok,
+        failed,
+        stopped,
+        timed_out,
+    };
+
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+        auto pipe = param->pipe.get();
+
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = param->io_event.get();
+
+        std::vector<uint8_t> buffer(1024);
+
+        io_result result = io_result::ok;
+        while (result != io_result::stopped) {
+            result = param->adopt_connect ? adopt_connect(param) : connect(param, overlapped);
+
+            while (result == io_result::ok) {
+                DWORD timeout = param->liveness_timeout.load(std::memory_order_relaxed);
+                DWORD bytes_read = 0;
+                result = read_message(param, overlapped, timeout, buffer, bytes_read);
+                if (result != io_result::ok)
+                    break;
+
+                // The successor gets this one, and the rest stays in the pipe.
+                if (param->handing_over.load(std::memory_order_relaxed)) {
+                    buffer.resize(bytes_read);
+                    param->leftover = std::move(buffer);
+                    result = io_result::stopped;
+                    break;
+                }
+
+                WIN_PIPE_PROBE("ReadComplete", TraceLoggingUInt32(bytes_read, "bytes"));
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+                if (!inject_fault(param, bytes_read)) {
+                    result = io_result::failed;
+                    break;
+                }
+#endif
+                sample_queue_depth(param);
+                uint64_t read_at = details::tracing_enabled() ? tsc_clock::now() : 0;
+                update_topics(param);
+                dispatch(param, buffer.data(), bytes_read, read_at);
+                if (param->unacked >= param->ack_batch || param->topics_unsent)
+                    send_control(param);
+            }
+
+            if (!HasOverlappedIoCompleted(&param->control_overlapped)) {
+                DWORD unused = 0;
+                CancelIoEx(pipe, &param->control_overlapped);
+                GetOverlappedResult(pipe, &param->control_overlapped, &unused, TRUE);
+            }
+
+            // Leave the sender connected for the successor to pick up.
+            if (result == io_result::stopped && param->handing_over.load(std::memory_order_relaxed))
+                break;
+
+            DisconnectNamedPipe(pipe);
+        }
+
+        return TRUE;
+    }
+
+    /// <summary>
+    /// read_at is when the message was read, for tracing, or 0 if not
+    /// tracing.
+    /// </summary>
+    static void dispatch(thread_param* param, uint8_t* data, DWORD size, uint64_t read_at)
+    {
+        details::message_header header {};
+        bool accepted = details::accept_message(data, size, param->expired_count, header);
+        if (header.flags & details::message_flags::hello) {
+            on_hello(param, data, size);
+            return;
+        }
+
+        // Expired messages count as delivered, or they'd never be
+        // acknowledged.
+        if (header.flags & details::message_flags::ack_requested) {
+            if (header.sequence <= param->delivered) {
+                param->duplicate_count.fetch_add(1, std::memory_order_relaxed);
+
+                // Sent again, so the sender never heard the acknowledgement,
+                // and may be waiting for it to send anything new.
+                param->unacked = std::max<uint32_t>(param->unacked, 1);
+                send_control(param);
+                return;
+            }
+            param->delivered = header.sequence;
+            param->unacked++;
+        }
+
+        if (!accepted)
+            return;
+
+        // Whatever the sender sent before it heard about the topics.
+        const auto& topics = param->active_topics;
+        if (header.topic != 0 && !topics.empty()
+            && !std::binary_search(topics.begin(), topics.end(), header.topic)) {
+            param->unwanted_count.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Transit covers the kernel and the wakeup of this thread together,
+        // since there's no telling them apart from user mode.
+        if (read_at != 0 && header.sent_at != 0)
+            details::trace("transit", header.sent_at, read_at, size);
+
+        constexpr size_t header_size = sizeof(details::message_header);
+        uint64_t callback_begin = 0;
+        uint64_t callback_end = 0;
+        std::shared_ptr<details::callback_monitor> slow;
+        {
+            std::lock_guard lock { param->callback_mutex };
+            auto* monitor = param->monitor.get();
+            bool timed = read_at != 0 || param->stats || monitor;
+            callback_begin = timed ? tsc_clock::now() : 0;
+            if (monitor)
+                monitor->begin(callback_begin, size - header_size);
+            WIN_PIPE_PROBE("CallbackStart", TraceLoggingUInt32(size - (DWORD)header_size, "bytes"));
+            if (param->extended_callback) {
+                message_info info { param->connection_id, param->client_pid, header.sequence,
+                    read_at != 0 ? read_at : tsc_clock::now() };
+                param->extended_callback(data + header_size, (size_t)size - header_size, info);
+            }
+            else {
+                param->callback(data + header_size, (size_t)size - header_size);
+            }
+            WIN_PIPE_PROBE("CallbackEnd", TraceLoggingUInt32(size - (DWORD)header_size, "bytes"));
+            callback_end = timed ? tsc_clock::now() : 0;
+            if (monitor && monitor->end(callback_end - callback_begin))
+                slow = param->monitor;
+        }
+
+        // Outside the lock, so that the hook can call set_callback or
+        // set_callback_limits.
+        if (slow)
+            slow->report(callback_end - callback_begin, size - header_size);
+        details::count_message(param->stats.get(), size - header_size, callback_end - callback_begin);
+        if (read_at != 0) {
+            details::trace("dispatch", read_at, callback_begin, size);
+            details::trace("callback", callback_begin, callback_end, size);
+        }
+
+        if (param->draining.load(std::memory_order_relaxed))
+            param->drained_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+    /// <summary>
+    /// Returns false if the connection should be dropped.
+    /// </summary>
+    static bool inject_fault(thread_param* param, DWORD& bytes_read)
+    {
+        std::shared_ptr<fault_injector> faults;
+        {
+            std::lock_guard lock { param->callback_mutex };
+            faults = param->faults;
+        }
+        if (!faults)
+            return true;
+
+        switch (faults->next()) {
+        case fault::disconnect:
+            return false;
+        case fault::partial_write:
+            bytes_read = std::max<DWORD>(bytes_read / 2, sizeof(details::message_header));
+            return true;
+        case fault::delay:
+            Sleep((DWORD)faults->delay().count());
+            return true;
+        default:
+            return true;
+        }
+    }
+#endif
+
+    /// <summary>
+    /// Peeking is a system call, so the queue depth is only sampled every
+    /// 100ms, not for every message.
+    /// </summary>
+    static void sample_queue_depth(thread_param* param)
+    {
+        if (!param->stats)
+            return;
+
+        ULONGLONG now = GetTickCount64();
+        if (now - param->last_peek < 100)
+            return;
+        param->last_peek = now;
+
+        DWORD available = 0;
+        PeekNamedPipe(param->pipe.get(), NULL, NULL, NULL, &available, NULL);
+        param->stats->queue_depth.store(available, std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Finishes the connect that a lazily started receiver left pending.
+    /// </summary>
+    static io_result adopt_connect(thread_param* param)
+    {
+        param->adopt_connect = false;
+
+        DWORD unused = 0;
+        io_result result = wait(param, param->first_connect, INFINITE, unused);
+        if (result == io_result::ok)
+            on_connected(param);
+        return result;
+    }
+
+    static io_result connect(thread_param* param, OVERLAPPED& overlapped)
+    {
+        io_result result = accept(param, overlapped);
+        if (result == io_result::ok)
+            on_connected(param);
+        return result;
+    }
+
+    static void on_hello(thread_param* param, const uint8_t* data, DWORD size)
+    {
+        details::hello_message hello;
+        if (size < sizeof(details::message_header) + sizeof(hello))
+            return;
+        std::memcpy(&hello, data + sizeof(details::message_header), sizeof(hello));
+
+        // Duplicates can only be told apart within the same sender's stream.
+        if (hello.stream_id != param->stream_id) {
+            param->stream_id = hello.stream_id;
+            param->delivered = 0;
+        }
+
+        // A sender that reconnected may have missed the acknowledgement for
+        // what was already delivered, so it's sent again right away rather
+        // than after the next batch, which might never come if its window
+        // is full.
+        else if (param->delivered != 0) {
+            param->unacked = std::max<uint32_t>(param->unacked, 1);
+            send_control(param);
+        }
+
+        // Acknowledging well before the window fills keeps the sender from
+        // ever having to wait, as long as this end keeps up.
+        param->ack_batch = std::max<uint32_t>(hello.window / 4, 1);
+    }
+
+    /// <summary>
+    /// Picks up topics changed by set_topics, to be filtered on from now on
+    /// and sent to the sender.
+    /// </summary>
+    static void update_topics(thread_param* param)
+    {
+        uint64_t version = param->topics_version.load(std::memory_order_relaxed);
+        if (version == param->active_topics_version)
+            return;
+        param->active_topics_version = version;
+
+        std::lock_guard lock { param->topics_mutex };
+        param->active_topics = param->topics;
+        param->topics_unsent = true;
+    }
+
+    /// <summary>
+    /// Tells the sender about changed topics, or else acknowledges everything
+    /// up to the last delivered message. Never waits: if the previous message
+    /// is still on its way, this is tried again once it's gone.
+    /// </summary>
+    static void send_control(thread_param* param)
+    {
+        if (!HasOverlappedIoCompleted(&param->control_overlapped))
+            return;
+
+        details::message_header header {};
+        const auto& topics = param->active_topics;
+        if (param->topics_unsent) {
+            header.flags = details::message_flags::topics;
+            details::frame_message(param->control, header, topics.data(),
+                (DWORD)(topics.size() * sizeof(uint32_t)));
+            param->topics_unsent = false;
+        }
+        else if (param->unacked != 0) {
+            header.flags = details::message_flags::ack;
+            header.sequence = param->delivered;
+            details::frame_message(param->control, header, &header, 0);
+            param->unacked = 0;
+        }
+        else {
+            return;
+        }
+
+        // A broken pipe shows up on the next read anyway.
+        WriteFile(param->pipe.get(), param->control.data(), (DWORD)param->control.size(),
+            NULL, &param->control_overlapped);
+    }
+
+    static void on_connected(thread_param* param)
+    {
+        // Looked up here once, rather than for every message.
+        ULONG pid = 0;
+        GetNamedPipeClientProcessId(param->pipe.get(), &pid);
+        param->client_pid = pid;
+        param->connection_id++;
+        param->unacked = 0;
+
+        // Every new sender needs to know, even if it's everything.
+        update_topics(param);
+        param->topics_unsent = true;
+        send_control(param);
+
+        if (param->stats)
+            details::bump(param->stats->reconnects, 1);
+    }
+
+    static io_result accept(thread_param* param, OVERLAPPED& overlapped)
+    {
+        auto pipe = param->pipe.get();
+
+        if (param->draining.load(std::memory_order_relaxed))
+            return io_result::stopped;
+
+        if (ConnectNamedPipe(pipe, &overlapped))
+            return io_result::ok;
+
+        switch (GetLastError()) {
+        case ERROR_PIPE_CONNECTED:
+            return io_result::ok;
+        case ERROR_IO_PENDING: {
+            DWORD unused = 0;
+            return wait(param, overlapped, INFINITE, unused);
+        }
+        default:
+            return io_result::failed;
+        }
+    }
+
+    static io_result read_message(thread_param* param, OVERLAPPED& overlapped,
+        DWORD timeout, std::vector<uint8_t>& buffer, DWORD& bytes_read)
+    {
+        io_result result = read(param, overlapped, timeout,
+            buffer.data(), (DWORD)buffer.size(), bytes_read);
+        if (result != io_result::failed || GetLastError() != ERROR_MORE_DATA)
+            return result;
+
+        DWORD leftover = 0;
+        PeekNamedPipe(param->pipe.get(), NULL, NULL, NULL, NULL, &leftover);
+        buffer.resize(bytes_read + leftover);
+        WIN_PIPE_PROBE("BufferRegrowth", TraceLoggingUInt32((UINT32)buffer.size(), "bytes"));
+
+        DWORD more_bytes_read = 0;
+        result = read(param, overlapped, timeout,
+            buffer.data() + bytes_read, leftover, more_bytes_read);
+        bytes_read += more_bytes_read;
+        return result;
+    }
+
+    static io_result read(thread_param* param, OVERLAPPED& overlapped,
+        DWORD timeout, uint8_t* data, DWORD size, DWORD& bytes_read)
+    {
+        // A read that completes immediately still signals the event, and so
+        // does one that fills the buffer with more of the message left over.
+        if (!ReadFile(param->pipe.get(), data, size, NULL, &overlapped)) {
+            DWORD error = GetLastError();
+            if (error != ERROR_IO_PENDING && error != ERROR_MORE_DATA)
+                return io_result::failed;
+
+            // Caught up with the sender, so acknowledge now rather than leave
+            // it waiting for a full batch.
+            if (error == ERROR_IO_PENDING)
+                send_control(param);
+        }
+
+        return wait(param, overlapped, timeout, bytes_read);
+    }
+
+    /// <summary>
+    /// Waits for the pending operation on the pipe to complete. If the stop
+    /// event is signaled or the timeout passes first, the operation is
+    /// cancelled before returning.
+    /// <para/>
+    /// While draining or handing over, an operation that managed to complete
+    /// anyway (i.e. there was still data in the pipe) counts as completed
+    /// rather than stopped, so that no message that was already read is lost.
+    /// </summary>
+    static io_result wait(thread_param* param, OVERLAPPED& overlapped,
+        DWORD timeout, DWORD& bytes)
+    {
+        auto pipe = param->pipe.get();
+
+        // Topics changed while waiting are passed on right away. And while
+        // something couldn't be sent back because the previous message was
+        // still on its way, also wait for that one, so the sender isn't left
+        // waiting for it.
+        // Those wakeups don't restart the timeout, which runs from the start
+        // of the wait, i.e. from the last message read.
+        HANDLE handles[] { param->event.get(), overlapped.hEvent,
+            param->topics_event.get(), param->control_event.get() };
+        ULONGLONG deadline = timeout == INFINITE ? 0 : GetTickCount64() + timeout;
+        DWORD status = WAIT_OBJECT_0 + 2;
+        while (status == WAIT_OBJECT_0 + 2 || status == WAIT_OBJECT_0 + 3) {
+            bool unsent = param->unacked != 0 || param->topics_unsent;
+            status = WaitForMultipleObjects(unsent ? 4 : 3, handles, FALSE,
+                timeout == INFINITE ? INFINITE : details::time_left(deadline));
+            if (status == WAIT_OBJECT_0 + 2)
+                update_topics(param);
+            if (status == WAIT_OBJECT_0 + 2 || status == WAIT_OBJECT_0 + 3)
+                send_control(param);
+        }
+        if (status != WAIT_OBJECT_0 + 1) {
+            CancelIoEx(pipe, &overlapped);
+            BOOL completed = GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+
+            if (status == WAIT_TIMEOUT)
+                return io_result::timed_out;
+            if (!param->draining.load(std::memory_order_relaxed)
+                && !param->handing_over.load(std::memory_order_relaxed))
+                return io_result::stopped;
+            if (completed)
+                return io_result::ok;
+            return GetLastError() == ERROR_MORE_DATA ? io_result::failed : io_result::stopped;
+        }
+
+        if (!GetOverlappedResult(pipe, &overlapped, &bytes, FALSE))
+            return io_result::failed;
+
+        return io_result::ok;
+    }
+
+private:
+    struct thread_param {
+        details::unique_handle pipe;
+        details::unique_handle event;
+        details::unique_handle io_event;
+        std::mutex callback_mutex;
+        callback_t callback;
+        extended_callback_t extended_callback;
+        // Of the sender currently connected.
+        uint64_t connection_id = 0;
+        DWORD client_pid = 0;
+        std::atomic<DWORD> liveness_timeout { INFINITE };
+        std::atomic<bool> draining { false };
+        std::atomic<bool> handing_over { false };
+        std::vector<uint8_t> leftover;
+        std::string name;
+        std::atomic<uint64_t> expired_count { 0 };
+        std::atomic<uint64_t> drained_count { 0 };
+        std::atomic<uint64_t> duplicate_count { 0 };
+        std::atomic<uint64_t> unwanted_count { 0 };
+        // Set by set_topics, and copied to active_topics by the thread.
+        std::mutex topics_mutex;
+        std::vector<uint32_t> topics;
+        std::atomic<uint64_t> topics_version { 0 };
+        details::unique_handle topics_event;
+        std::vector<uint32_t> active_topics;
+        uint64_t active_topics_version = 0;
+        bool topics_unsent = false;
+        // Messages back to the sender. control is the one being written.
+        details::unique_handle control_event;
+        OVERLAPPED control_overlapped {};
+        std::vector<uint8_t> control;
+        // Acknowledgements, for senders that ask for them.
+        uint64_t stream_id = 0;
+        uint64_t delivered = 0;
+        uint32_t unacked = 0;
+        uint32_t ack_batch = 16;
+        details::unique_stats stats;
+        ULONGLONG last_peek = 0;
+        std::shared_ptr<details::callback_monitor> monitor;
+        // While a lazily started receiver waits for its first sender.
+        HANDLE start_wait = NULL;
+        OVERLAPPED first_connect {};
+        details::unique_handle lazy_thread;
+        bool adopt_connect = false;
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+        std::shared_ptr<fault_injector> faults;
+#endif
+    };
+
+private:
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+
+// ------------------------------------------------------------[ pooled_receiver
+
+/// <summary>
+/// A receiver without a thread of its own, for processes with thousands of
+/// channels. Its pipe is bound to the system thread pool, so connects and
+/// reads complete on whichever pool thread is free, and an idle channel
+/// costs no thread and no CPU. The read buffer is only allocated while a
+/// sender is connected.
+/// <para/>
+/// Callbacks for one channel never overlap, but callbacks for different
+/// channels run in parallel. Supports deadlines and stats like receiver
+/// does, but not draining, handover, liveness timeouts or callback limits.
+/// </summary>
+class pooled_receiver {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No pipe is opened/created.
+    /// </summary>
+    pooled_receiver() = default;
+
+    pooled_receiver(std::string_view name, callback_t callback)
+    {
+        m_param = std::make_unique<io_param>();
+        m_param->callback = callback;
+
+        std::string pipe_name { details::format_name(name) };
+        m_param->pipe.reset(CreateNamedPipeA(
+            pipe_name.c_str(),
+            PIPE_ACCESS_INBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+            1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
+        if (m_param->pipe.get() == INVALID_HANDLE_VALUE) {
+            std::string msg { "Pipe creation failed: " };
+            msg += std::to_string(GetLastError());
+            throw std::runtime_error(msg);
+        }
+
+        m_param->idle_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->io = CreateThreadpoolIo(m_param->pipe.get(), completion, m_param.get(), NULL);
+        if (!m_param->io) {
+            std::string msg { "Thread pool binding failed: " };
+            msg += std::to_string(GetLastError());
+            throw std::runtime_error(msg);
+        }
+
+        m_param->stats = details::register_channel(channel_kind::receiver, name);
+
+        std::lock_guard lock { m_param->io_mutex };
+        issue(m_param.get());
+    }
+
+    pooled_receiver(pooled_receiver&&) noexcept = default;
+
+    ~pooled_receiver()
+    {
+        stop();
+    }
+
+    pooled_receiver& operator=(pooled_receiver&& other) noexcept
+    {
+        if (this != &other) {
+            stop();
+            m_param = std::move(other.m_param);
+        }
+        return *this;
+    }
+
+    void set_callback(callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->callback = callback;
+    }
+
+    /// <summary>
+    /// Number of messages that were skipped without invoking the callback
+    /// because their deadline had already passed by the time they were read.
+    /// </summary>
+    uint64_t expired_count() const
+    {
+        return m_param ? m_param->expired_count.load(std::memory_order_relaxed) : 0;
+    }
+
+    /// <summary>
+    /// Number of times waiting for a sender failed with an unexpected error.
+    /// Each one is retried after disconnecting, so a nonzero count alone
+    /// doesn't mean the channel stopped accepting senders.
+    /// </summary>
+    uint64_t failed_connect_count() const
+    {
+        return m_param ? m_param->failed_connects.load(std::memory_order_relaxed) : 0;
+    }
+
+private:
+    struct io_param;
+
+    // Retries in a row before issue gives up on a pipe that keeps failing,
+    // rather than spin with io_mutex held.
+    static constexpr int max_connect_retries = 3;
+
+    /// <summary>
+    /// Cancels whatever is pending and waits for the last completion, after
+    /// which nothing refers to the io_param anymore.
+    /// </summary>
+    void stop()
+    {
+        if (!m_param || !m_param->io)
+            return;
+
+        {
+            std::lock_guard lock { m_param->io_mutex };
+            m_param->stopping = true;
+            CancelIoEx(m_param->pipe.get(), NULL);
+        }
+
+        WaitForSingleObject(m_param->idle_event.get(), INFINITE);
+        WaitForThreadpoolIoCallbacks(m_param->io, FALSE);
+        CloseThreadpoolIo(m_param->io);
+        m_param->io = NULL;
+    }
+
+    /// <summary>
+    /// Starts the next connect or read, whichever the channel is waiting
+    /// for, and returns once it's pending. Called with io_mutex held, so
+    /// that stop either sees it pending and cancels it, or it sees stopping
+    /// and doesn't start at all.
+    /// </summary>
+    static void issue(io_param* param)
+    {
+        auto pipe = param->pipe.get();
+        int retries = 0;
+
+        while (!param->stopping) {
+            StartThreadpoolIo(param->io);
+
+            if (!param->connected) {
+                if (ConnectNamedPipe(pipe, &param->overlapped))
+                    return;
+
+                DWORD error = GetLastError();
+                if (error == ERROR_IO_PENDING)
+                    return;
+
+                CancelThreadpoolIo(param->io);
+                if (error == ERROR_PIPE_CONNECTED) {
+                    on_connected(param);
+                    continue;
+                }
+
+                // A sender came and went before we got to it.
+                if (error == ERROR_NO_DATA) {
+                    DisconnectNamedPipe(pipe);
+                    continue;
+                }
+
+                // Anything else is retried after disconnecting, the same as
+                // receiver does, unless the pipe keeps failing.
+                param->failed_connects.fetch_add(1, std::memory_order_relaxed);
+                DisconnectNamedPipe(pipe);
+                if (++retries > max_connect_retries)
+                    break;
+                continue;
+            }
+
+            // Only allocated once there's something to read.
+            if (param->buffer.empty())
+                param->buffer.resize(1024);
+
+            if (ReadFile(pipe, param->buffer.data() + param->received,
+                    (DWORD)(param->buffer.size() - param->received), NULL, &param->overlapped))
+                return;
+
+            // ERROR_MORE_DATA still queues a completion, like success does.
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING || error == ERROR_MORE_DATA)
+                return;
+
+            CancelThreadpoolIo(param->io);
+            on_disconnected(param);
+        }
+
+        SetEvent(param->idle_event.get());
+    }
+
+    static void CALLBACK completion(PTP_CALLBACK_INSTANCE, PVOID context, PVOID,
+        ULONG result, ULONG_PTR bytes, PTP_IO)
+    {
+        auto* param = reinterpret_cast<io_param*>(context);
+
+        if (!param->connected) {
+            if (result == NO_ERROR || result == ERROR_PIPE_CONNECTED)
+                on_connected(param);
+            else
+                DisconnectNamedPipe(param->pipe.get());
+        }
+        else if (result == NO_ERROR) {
+            DWORD size = (DWORD)(param->received + bytes);
+            param->received = 0;
+            dispatch(param, size);
+        }
+        else if (result == ERROR_MORE_DATA) {
+            // Grow the buffer to fit the rest, and read it in after what's
+            // already there.
+            param->received += bytes;
+            DWORD leftover = 0;
+            PeekNamedPipe(param->pipe.get(), NULL, 0, NULL, NULL, &leftover);
+            param->buffer.resize(param->received + leftover);
+            WIN_PIPE_PROBE("BufferRegrowth", TraceLoggingUInt32((DWORD)param->buffer.size(), "bytes"));
+        }
+        else {
+            on_disconnected(param);
+        }
+
+        std::lock_guard lock { param->io_mutex };
+        issue(param);
+    }
+
+    static void on_connected(io_param* param)
+    {
+        param->connected = true;
+        if (param->stats)
+            details::bump(param->stats->reconnects, 1);
+    }
+
+    static void on_disconnected(io_param* param)
+    {
+        DisconnectNamedPipe(param->pipe.get());
+        param->connected = false;
+        param->received = 0;
+
+        // Nobody to read from until the next sender, so give the memory back.
+        param->buffer.clear();
+        param->buffer.shrink_to_fit();
+    }
+
+    static void dispatch(io_param* param, DWORD size)
+    {
+        uint8_t* data = param->buffer.data();
+
+        details::message_header header;
+        if (!details::accept_message(data, size, param->expired_count, header))
+            return;
+
+        constexpr size_t header_size = sizeof(details::message_header);
+        std::lock_guard lock { param->callback_mutex };
+        uint64_t callback_begin = param->stats ? tsc_clock::now() : 0;
+        param->callback(data + header_size, (size_t)size - header_size);
+        uint64_t callback_end = param->stats ? tsc_clock::now() : 0;
+        details::count_message(param->stats.get(), size - header_size, callback_end - callback_begin);
+    }
+
+private:
+    // Everything but the mutexes and stopping is only touched from the
+    // completion chain, which never has more than one link running.
+    struct io_param {
+        details::unique_handle pipe;
+        details::unique_handle idle_event;
+        PTP_IO io = NULL;
+        OVERLAPPED overlapped {};
+        std::mutex io_mutex;
+        bool stopping = false;
+        bool connected = false;
+        std::vector<uint8_t> buffer;
+        size_t received = 0;
+        std::mutex callback_mutex;
+        callback_t callback;
+        std::atomic<uint64_t> expired_count { 0 };
+        std::atomic<uint64_t> failed_connects { 0 };
+        details::unique_stats stats;
+    };
+
+    std::unique_ptr<io_param> m_param;
+};
+
+// -------------------------------------------------------------[ multi_receiver
+
+/// <summary>
+/// Counters for one sender connected to a multi_receiver.
+/// </summary>
+struct connection_stats {
+    // Unique among this receiver's connections, in the order they were made.
+    uint64_t id;
+    DWORD pid;
+    uint64_t messages;
+    uint64_t bytes;
+    // Scheduling rounds in which the sender had a message waiting but had
+    // used up its quantum, and so had to wait for the others.
+    uint64_t deferred;
+};
+
+namespace details {
+    /// <summary>
+    /// A message that a merging multi_receiver is holding back until nothing
+    /// older can still arrive.
+    /// </summary>
+    struct merge_entry {
+        uint64_t sent_at;
+        message_info info;
+        std::vector<uint8_t> payload;
+    };
+
+    // Makes the standard heap functions keep the oldest entry on top.
+    inline bool sent_later(const merge_entry& a, const merge_entry& b)
+    {
+        return a.sent_at > b.sent_at;
+    }
+
+    /// <summary>
+    /// One pipe instance of a multi_receiver, and the sender connected to it.
+    /// Only touched by the receiver's thread, except for the counters and
+    /// what connections() reads under connections_mutex.
+    /// </summary>
+    struct connection {
+        enum state_t {
+            connecting,
+            reading,
+            // A message is in buffer, waiting for its turn.
+            ready,
+            failed,
+        };
+
+        unique_handle pipe;
+        unique_handle event;
+        OVERLAPPED overlapped {};
+        state_t state = connecting;
+        std::vector<uint8_t> buffer;
+        DWORD size = 0;
+        size_t deficit = 0;
+        bool connected = false;
+        uint64_t id = 0;
+        DWORD pid = 0;
+        // Messages held back for merging, as a heap.
+        std::vector<merge_entry> held;
+        // sent_at of the newest message or heartbeat read from the sender.
+        uint64_t latest = 0;
+        std::atomic<uint64_t> messages { 0 };
+        std::atomic<uint64_t> bytes { 0 };
+        std::atomic<uint64_t> deferred { 0 };
+    };
+}
+
+/// <summary>
+/// A receiver that serves several senders at once, one pipe instance each,
+/// from a single thread. So that a chatty sender can't starve the rest,
+/// senders are served in deficit round robin: each round, every sender may
+/// have up to quantum bytes of messages passed to the callback, and unused
+/// allowance carries over to the next round as long as it has messages
+/// waiting. A sender that's over its allowance isn't read from, so it's
+/// slowed down by its own pipe filling up rather than by the others.
+/// <para/>
+/// Senders connect the same way as to a receiver. At most 63 can be
+/// connected at once.
+/// <para/>
+/// Messages from different senders are passed on in the order they were
+/// read, unless merging is turned on with set_merge_window.
+/// </summary>
+class multi_receiver {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No pipe is opened/created, and no
+    /// read thread is started.
+    /// </summary>
+    multi_receiver() = default;
+
+    /// <summary>
+    /// Throws if the pipe instances can't be created.
+    /// </summary>
+    multi_receiver(std::string_view name, callback_t callback,
+        size_t max_senders = 8, size_t quantum = 64 * 1024)
+    {
+        create(name, max_senders, quantum);
+        m_param->callback = callback;
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    /// <summary>
+    /// Same as above, except that the callback is also told which sender
+    /// each message came from.
+    /// </summary>
+    multi_receiver(std::string_view name, with_info_t, extended_callback_t callback,
+        size_t max_senders = 8, size_t quantum = 64 * 1024)
+    {
+        create(name, max_senders, quantum);
+        m_param->extended_callback = callback;
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    multi_receiver(multi_receiver&&) noexcept = default;
+
+    ~multi_receiver()
+    {
+        stop_thread();
+    }
+
+    multi_receiver& operator=(multi_receiver&& other) noexcept
+    {
+        if (this != &other) {
+            stop_thread();
+            m_param = std::move(other.m_param);
+            m_thread = std::move(other.m_thread);
+        }
+        return *this;
+    }
+
+    void set_callback(callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->callback = callback;
+        m_param->extended_callback = nullptr;
+    }
+
+    void set_extended_callback(extended_callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->extended_callback = callback;
+        m_param->callback = nullptr;
+    }
+
+    /// <summary>
+    /// Passes messages to the callback in the order they were sent, across
+    /// all senders, rather than in the order they were read. A message is
+    /// held back until every connected sender has sent something newer, or
+    /// until it's max_delay old, whichever comes first. So a quiet sender
+    /// holds up the rest by at most max_delay, and by no more than its
+    /// heartbeat interval if it sends heartbeats. A newly connected sender
+    /// doesn't hold up anything until its first message or heartbeat. A
+    /// message older than one already passed on is passed on right away, and
+    /// counted by late_count.
+    /// Zero (the default) turns merging off.
+    /// </summary>
+    void set_merge_window(std::chrono::microseconds max_delay)
+    {
+        if (!m_param)
+            return;
+
+        uint64_t window = max_delay.count() > 0 ? (uint64_t)max_delay.count() * 1000 : 0;
+        m_param->merge_window.store(window, std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Number of messages that arrived too late to be merged in order.
+    /// </summary>
+    uint64_t late_count() const
+    {
+        return m_param ? m_param->late_count.load(std::memory_order_relaxed) : 0;
+    }
+
+    /// <summary>
+    /// Counters for every sender currently connected.
+    /// </summary>
+    std::vector<connection_stats> connections() const
+    {
+        std::vector<connection_stats> result;
+        if (!m_param)
+            return result;
+
+        std::lock_guard lock { m_param->connections_mutex };
+        for (const auto& connection : m_param->connections) {
+            if (!connection->connected)
+                continue;
+
+            result.push_back(connection_stats {
+                connection->id,
+                connection->pid,
+                connection->messages.load(std::memory_order_relaxed),
+                connection->bytes.load(std::memory_order_relaxed),
+                connection->deferred.load(std::memory_order_relaxed),
+            });
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Number of messages that were skipped without invoking the callback
+    /// because their deadline had already passed by the time they were read.
+    /// </summary>
+    uint64_t expired_count() const
+    {
+        return m_param ? m_param->expired_count.load(std::memory_order_relaxed) : 0;
+    }
+
+private:
+    struct thread_param;
+
+    void create(std::string_view name, size_t max_senders, size_t quantum)
+    {
+        max_senders = std::clamp<size_t>(max_senders, 1, MAXIMUM_WAIT_OBJECTS - 1);
+
+        m_param = std::make_unique<thread_param>();
+        m_param->quantum = std::max<size_t>(quantum, 1);
+
+        std::string pipe_name { details::format_name(name) };
+        for (size_t i = 0; i < max_senders; i++) {
+            auto connection = std::make_unique<details::connection>();
+            connection->pipe.reset(CreateNamedPipeA(
+                pipe_name.c_str(),
+                PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | (i == 0 ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                (DWORD)max_senders, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
+            if (connection->pipe.get() == INVALID_HANDLE_VALUE) {
+                std::string msg { "Pipe creation failed: " };
+                msg += std::to_string(GetLastError());
+                throw std::runtime_error(msg);
+            }
+
+            connection->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+            connection->overlapped.hEvent = connection->event.get();
+            m_param->connections.push_back(std::move(connection));
+        }
+
+        m_param->stats = details::register_channel(channel_kind::receiver, name);
+        m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+    }
+
+    void stop_thread()
+    {
+        if (!m_thread)
+            return;
+
+        SetEvent(m_param->event.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_thread = nullptr;
+    }
+
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+        auto& connections = param->connections;
+
+        std::vector<HANDLE> handles { param->event.get() };
+        for (auto& connection : connections) {
+            handles.push_back(connection->event.get());
+            begin_connect(param, *connection);
+        }
+
+        size_t first = 0;
+        while (true) {
+            bool any_ready = std::any_of(connections.begin(), connections.end(),
+                [] (const auto& connection) { return connection->state == details::connection::ready; });
+
+            // With messages waiting, only look for more I/O in passing.
+            DWORD status = WaitForMultipleObjects((DWORD)handles.size(), handles.data(), FALSE,
+                any_ready ? 0 : merge_timeout(param));
+            if (status == WAIT_OBJECT_0 || status == WAIT_FAILED)
+                break;
+
+            for (auto& connection : connections) {
+                if (connection->state != details::connection::ready
+                    && HasOverlappedIoCompleted(&connection->overlapped))
+                    complete(param, *connection);
+            }
+
+            // One round, starting from a different sender each time so that
+            // none is always first.
+            size_t skipped = skip_rounds(param);
+            first = (first + skipped) % connections.size();
+            for (size_t i = 0; i < connections.size(); i++)
+                serve(param, *connections[(first + i) % connections.size()]);
+            first = (first + 1) % connections.size();
+
+            release(param, false);
+        }
+
+        // Whatever is still held back is passed on rather than lost.
+        release(param, true);
+
+        for (auto& connection : connections) {
+            if (!HasOverlappedIoCompleted(&connection->overlapped)) {
+                DWORD unused = 0;
+                CancelIoEx(connection->pipe.get(), &connection->overlapped);
+                GetOverlappedResult(connection->pipe.get(), &connection->overlapped, &unused, TRUE);
+            }
+        }
+
+        return TRUE;
+    }
+
+    /// <summary>
+    /// Goes through the rounds in which no waiting message would fit its
+    /// sender's allowance in one pass, by handing out their quanta all at
+    /// once, and returns how many that was. Otherwise a message much larger
+    /// than the quantum would take one trip around the thread loop, which
+    /// doesn't wait while messages are waiting, per quantum.
+    /// </summary>
+    static size_t skip_rounds(thread_param* param)
+    {
+        size_t rounds = SIZE_MAX;
+        for (auto& connection : param->connections) {
+            if (connection->state != details::connection::ready)
+                continue;
+            size_t short_by = connection->size > connection->deficit
+                ? connection->size - connection->deficit : 0;
+            rounds = std::min<size_t>(rounds, (short_by + param->quantum - 1) / param->quantum);
+        }
+
+        // The round about to be served accounts for one of them.
+        if (rounds == SIZE_MAX || rounds <= 1)
+            return 0;
+
+        size_t skipped = rounds - 1;
+        for (auto& connection : param->connections) {
+            if (connection->state != details::connection::ready)
+                continue;
+            connection->deficit += skipped * param->quantum;
+            details::bump(connection->deferred, skipped);
+        }
+        return skipped;
+    }
+
+    /// <summary>
+    /// Passes on the connection's waiting messages, as far as its allowance
+    /// for this round goes.
+    /// </summary>
+    static void serve(thread_param* param, details::connection& connection)
+    {
+        if (connection.state != details::connection::ready) {
+            connection.deficit = 0;
+            return;
+        }
+
+        connection.deficit += param->quantum;
+        while (connection.state == details::connection::ready && connection.size <= connection.deficit) {
+            connection.deficit -= connection.size;
+            dispatch(param, connection);
+            begin_read(param, connection);
+        }
+
+        if (connection.state == details::connection::ready)
+            details::bump(connection.deferred, 1);
+        else
+            connection.deficit = 0;
+    }
+
+    static void begin_connect(thread_param* param, details::connection& connection)
+    {
+        while (true) {
+            connection.state = details::connection::connecting;
+            if (ConnectNamedPipe(connection.pipe.get(), &connection.overlapped))
+                return;
+
+            switch (GetLastError()) {
+            case ERROR_IO_PENDING:
+                return;
+            case ERROR_PIPE_CONNECTED:
+                on_connected(param, connection);
+                begin_read(param, connection);
+                return;
+            case ERROR_NO_DATA:
+                // A sender came and went before we got to it.
+                DisconnectNamedPipe(connection.pipe.get());
+                continue;
+            default:
+                // Leave the instance be, so the loop doesn't spin on it.
+                connection.state = details::connection::failed;
+                ResetEvent(connection.event.get());
+                return;
+            }
+        }
+    }
+
+    static void begin_read(thread_param* param, details::connection& connection)
+    {
+        connection.state = details::connection::reading;
+        if (connection.buffer.empty())
+            connection.buffer.resize(1024);
+
+        // Whether it completes now or later, complete picks it up.
+        if (ReadFile(connection.pipe.get(), connection.buffer.data(),
+                (DWORD)connection.buffer.size(), NULL, &connection.overlapped)) {
+            complete(param, connection);
+            return;
+        }
+
+        DWORD error = GetLastError();
+        if (error == ERROR_IO_PENDING)
+            return;
+        if (error == ERROR_MORE_DATA) {
+            complete(param, connection);
+            return;
+        }
+
+        on_disconnected(param, connection);
+        begin_connect(param, connection);
+    }
+
+    static void complete(thread_param* param, details::connection& connection)
+    {
+        auto pipe = connection.pipe.get();
+        DWORD bytes = 0;
+        BOOL success = GetOverlappedResult(pipe, &connection.overlapped, &bytes, FALSE);
+
+        if (connection.state == details::connection::connecting) {
+            if (success || GetLastError() == ERROR_PIPE_CONNECTED) {
+                on_connected(param, connection);
+                begin_read(param, connection);
+            }
+            else {
+                DisconnectNamedPipe(pipe);
+                begin_connect(param, connection);
+            }
+            return;
+        }
+
+        if (connection.state != details::connection::reading)
+            return;
+
+        // The rest of the message is already in the pipe, so reading it
+        // doesn't wait on the sender.
+        if (!success && GetLastError() == ERROR_MORE_DATA) {
+            DWORD leftover = 0;
+            PeekNamedPipe(pipe, NULL, 0, NULL, NULL, &leftover);
+            connection.buffer.resize(bytes + leftover);
+            WIN_PIPE_PROBE("BufferRegrowth", TraceLoggingUInt32((DWORD)connection.buffer.size(), "bytes"));
+
+            DWORD rest = 0;
+            BOOL started = ReadFile(pipe, connection.buffer.data() + bytes, leftover, NULL, &connection.overlapped);
+            success = details::finish_overlapped(pipe, connection.overlapped, started, INFINITE, rest);
+            bytes += rest;
+        }
+
+        if (!success) {
+            on_disconnected(param, connection);
+            begin_connect(param, connection);
+            return;
+        }
+
+        connection.state = details::connection::ready;
+        connection.size = bytes;
+    }
+
+    static void on_connected(thread_param* param, details::connection& connection)
+    {
+        ULONG pid = 0;
+        GetNamedPipeClientProcessId(connection.pipe.get(), &pid);
+
+        std::lock_guard lock { param->connections_mutex };
+        connection.id = ++param->last_connection_id;
+        connection.pid = pid;
+        connection.messages.store(0, std::memory_order_relaxed);
+        connection.bytes.store(0, std::memory_order_relaxed);
+        connection.deferred.store(0, std::memory_order_relaxed);
+        connection.deficit = 0;
+        connection.latest = 0;
+        connection.connected = true;
+
+        if (param->stats)
+            details::bump(param->stats->reconnects, 1);
+    }
+
+    static void on_disconnected(thread_param* param, details::connection& connection)
+    {
+        DisconnectNamedPipe(connection.pipe.get());
+
+        std::lock_guard lock { param->connections_mutex };
+        connection.connected = false;
+    }
+
+    static void dispatch(thread_param* param, details::connection& connection)
+    {
+        uint8_t* data = connection.buffer.data();
+        DWORD size = connection.size;
+
+        // Heartbeats and expired messages never reach the callback, but still
+        // show how far along the sender is.
+        details::message_header header {};
+        bool accepted = details::accept_message(data, size, param->expired_count, header);
+        connection.latest = std::max<uint64_t>(connection.latest, header.sent_at);
+        if (!accepted)
+            return;
+
+        constexpr size_t header_size = sizeof(details::message_header);
+        details::bump(connection.messages, 1);
+        details::bump(connection.bytes, size - header_size);
+
+        message_info info { connection.id, connection.pid, header.sequence, 0 };
+        if (param->merge_window.load(std::memory_order_relaxed) != 0) {
+            if (header.sent_at >= param->released_up_to) {
+                hold(param, connection, header.sent_at, info, data + header_size, size - header_size);
+                return;
+            }
+            details::bump(param->late_count, 1);
+        }
+
+        deliver(param, data + header_size, size - header_size, info);
+    }
+
+    static void deliver(thread_param* param, uint8_t* data, size_t size, message_info info)
+    {
+        std::lock_guard lock { param->callback_mutex };
+        uint64_t callback_begin = param->stats || param->extended_callback ? tsc_clock::now() : 0;
+        if (param->extended_callback) {
+            // Strictly, when it got its turn, which is close enough to when
+            // it was read unless it was held back for merging.
+            info.received_at = callback_begin;
+            param->extended_callback(data, size, info);
+        }
+        else {
+            param->callback(data, size);
+        }
+        uint64_t callback_end = param->stats ? tsc_clock::now() : 0;
+
+        details::count_message(param->stats.get(), size, callback_end - callback_begin);
+    }
+
+    static void hold(thread_param* param, details::connection& connection, uint64_t sent_at,
+        const message_info& info, const uint8_t* data, size_t size)
+    {
+        std::vector<uint8_t> payload;
+        if (!param->spare.empty()) {
+            payload = std::move(param->spare.back());
+            param->spare.pop_back();
+        }
+        payload.assign(data, data + size);
+
+        connection.held.push_back(details::merge_entry { sent_at, info, std::move(payload) });
+        std::push_heap(connection.held.begin(), connection.held.end(), details::sent_later);
+        param->held++;
+    }
+
+    /// <summary>
+    /// Passes on held back messages, oldest first, for as long as the oldest
+    /// can't be beaten by anything still to arrive or has waited out the
+    /// merge window. Passes on everything if flushing or not merging.
+    /// </summary>
+    static void release(thread_param* param, bool flush)
+    {
+        if (param->held == 0)
+            return;
+
+        uint64_t window = param->merge_window.load(std::memory_order_relaxed);
+        flush = flush || window == 0;
+
+        // Each sender's messages come in the order they were sent, so none
+        // still to come is older than the newest one read from the sender
+        // that's furthest behind. One that hasn't sent anything yet has no
+        // say, or it would hold everything up for the whole window.
+        uint64_t watermark = UINT64_MAX;
+        for (const auto& connection : param->connections) {
+            if (connection->connected && connection->latest != 0)
+                watermark = std::min<uint64_t>(watermark, connection->latest);
+        }
+        uint64_t now = tsc_clock::now();
+
+        while (param->held != 0) {
+            details::connection* oldest = nullptr;
+            for (const auto& connection : param->connections) {
+                if (!connection->held.empty()
+                    && (!oldest || connection->held.front().sent_at < oldest->held.front().sent_at))
+                    oldest = connection.get();
+            }
+
+            uint64_t sent_at = oldest->held.front().sent_at;
+            bool overdue = now > sent_at && tsc_clock::to_nanoseconds(now - sent_at) >= window;
+            if (!flush && sent_at > watermark && !overdue)
+                return;
+
+            std::pop_heap(oldest->held.begin(), oldest->held.end(), details::sent_later);
+            details::merge_entry entry = std::move(oldest->held.back());
+            oldest->held.pop_back();
+            param->held--;
+            param->released_up_to = std::max<uint64_t>(param->released_up_to, sent_at);
+
+            deliver(param, entry.payload.data(), entry.payload.size(), entry.info);
+            param->spare.push_back(std::move(entry.payload));
+        }
+    }
+
+    /// <summary>
+    /// How long the thread can wait for I/O before the oldest held back
+    /// message is due.
+    /// </summary>
+    static DWORD merge_timeout(thread_param* param)
+    {
+        if (param->held == 0)
+            return INFINITE;
+
+        uint64_t window = param->merge_window.load(std::memory_order_relaxed);
+        uint64_t oldest = UINT64_MAX;
+        for (const auto& connection : param->connections) {
+            if (!connection->held.empty())
+                oldest = std::min<uint64_t>(oldest, connection->held.front().sent_at);
+        }
+
+        uint64_t now = tsc_clock::now();
+        uint64_t waited = now > oldest ? tsc_clock::to_nanoseconds(now - oldest) : 0;
+        if (waited >= window)
+            return 0;
+
+        // Round up, so as not to wake just before it's due.
+        return (DWORD)((window - waited + 999'999) / 1'000'000);
+    }
+
+private:
+    struct thread_param {
+        details::unique_handle event;
+        std::mutex callback_mutex;
+        callback_t callback;
+        extended_callback_t extended_callback;
+        size_t quantum = 0;
+        // The vector itself never changes once the thread is started.
+        std::vector<std::unique_ptr<details::connection>> connections;
+        mutable std::mutex connections_mutex;
+        uint64_t last_connection_id = 0;
+        std::atomic<uint64_t> expired_count { 0 };
+        // Nanoseconds, or 0 when not merging.
+        std::atomic<uint64_t> merge_window { 0 };
+        std::atomic<uint64_t> late_count { 0 };
+        // Only touched by the thread.
+        size_t held = 0;
+        uint64_t released_up_to = 0;
+        std::vector<std::vector<uint8_t>> spare;
+        details::unique_stats stats;
+    };
+
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+
+// ---------------------------------------------------------------------[ sender
+
+class sender {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. Cannot actually write to a pipe.
+    /// <para />
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    sender() = default;
+
+    sender(std::string_view name, connect_mode mode = connect_mode::eager)
+    {
+        m_param = std::make_unique<thread_param>();
+        m_param->name = details::format_name(name);
+        m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->io_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->control_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->stats = details::register_channel(channel_kind::sender, name);
+
+        switch (mode) {
+        case connect_mode::lazy:
+            break;
+        case connect_mode::eager:
+            connect(*m_param);
+            break;
+        case connect_mode::async:
+            m_param->connect_async = true;
+            restart_thread();
+            break;
+        }
+    }
+
+    sender(sender&&) noexcept = default;
+
+    ~sender()
+    {
+        stop_thread();
+    }
+
+    sender& operator=(sender&& other) noexcept
+    {
+        if (this != &other) {
+            stop_thread();
+            m_param = std::move(other.m_param);
+            m_thread = std::move(other.m_thread);
+        }
+        return *this;
+    }
+
+    bool send(const void* buffer, DWORD size)
+    {
+        return send(buffer, size, no_deadline);
+    }
+
+    /// <summary>
+    /// Sends a message that the receiver will drop, without invoking its
+    /// callback, if it has not been read by the time the deadline passes.
+    /// Useful for data that goes stale quickly, so that a receiver which has
+    /// fallen behind can catch up instead of processing outdated messages.
+    /// </summary>
+    bool send(const void* buffer, DWORD size, deadline_t deadline)
+    {
+        return send_message(0, buffer, size, deadline);
+    }
+
+    /// <summary>
+    /// Sends a message tagged with a topic, which a receiver that's set its
+    /// topics without this one drops. Once the receiver has told this sender
+    /// its topics, such messages aren't even written to the pipe, and count
+    /// as sent.
+    /// </summary>
+    bool send(std::string_view topic, const void* buffer, DWORD size,
+        deadline_t deadline = no_deadline)
+    {
+        return send_message(details::topic_id(topic), buffer, size, deadline);
+    }
+
+    /// <summary>
+    /// Number of messages that weren't written because the receiver didn't
+    /// want their topic.
+    /// </summary>
+    uint64_t unwanted_count() const
+    {
+        return m_param ? m_param->unwanted_count.load(std::memory_order_relaxed) : 0;
+    }
+
+    /// <summary>
+    /// Sends a tiny heartbeat message whenever nothing has been sent for the
+    /// given interval, so that a receiver with a liveness timeout can tell an
+    /// idle sender apart from a dead one. Heartbeats are only sent while
+    /// connected, and cost nothing while real messages are flowing. Zero (the
+    /// default) disables heartbeats.
+    /// </summary>
+    void set_heartbeat_interval(std::chrono::milliseconds interval)
+    {
+        if (!m_param)
+            return;
+
+        stop_thread();
+        m_param->heartbeat_interval = interval.count() > 0 ? (DWORD)interval.count() : 0;
+        restart_thread();
+    }
+
+    /// <summary>
+    /// How long a send may wait on a receiver that has stopped reading. When
+    /// the timeout passes, the receiver is assumed dead, the send fails and
+    /// the next send reconnects. Zero (the default) waits forever.
+    /// <para/>
+    /// Note: with a timeout set, sends no longer wait for the receiver to read
+    /// each message (FlushFileBuffers can't be bounded), only for space in the
+    /// pipe's buffer.
+    /// </summary>
+    void set_peer_timeout(std::chrono::milliseconds timeout)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->mutex };
+        m_param->peer_timeout = timeout.count() > 0 ? (DWORD)timeout.count() : INFINITE;
+    }
+
+    /// <summary>
+    /// Turns on at-least-once delivery. Up to window messages are kept until
+    /// the receiver acknowledges passing them to its callback, and are sent
+    /// again after reconnecting, so that a receiver that restarts doesn't
+    /// lose what was still in the pipe. The receiver acknowledges in batches,
+    /// so sends only wait when the window is full. Zero (the default) turns
+    /// it off again, forgetting whatever is unacknowledged.
+    /// <para/>
+    /// With this on, send succeeds as soon as the message is in the window,
+    /// connected or not, and only fails if the window is full and no receiver
+    /// can be reached to make room. Messages can arrive twice if a receiver
+    /// is replaced before acknowledging them.
+    /// <para/>
+    /// Note: only receiver sends acknowledgements. multi_receiver and
+    /// pooled_receiver create their pipes inbound only, so a sender with a
+    /// window can't connect to them at all. Reconnects, if already connected,
+    /// to introduce this sender to the receiver, and returns false, leaving
+    /// acknowledgements off, if that receiver turns out to be one of those.
+    /// </summary>
+    bool set_ack_window(uint32_t window)
+    {
+        if (!m_param)
+            return false;
+
+        std::lock_guard lock { m_param->mutex };
+        m_param->window.clear();
+        m_param->window.resize(window);
+        m_param->acked = m_param->sequence;
+        if (m_param->stream_id == 0)
+            m_param->stream_id = ((uint64_t)GetCurrentProcessId() << 32) ^ tsc_clock::now();
+
+        if (!m_param->pipe || window == 0)
+            return true;
+        if (connect(*m_param))
+            return true;
+
+        // Connected before, so most likely the receiver can't send back.
+        if (GetLastError() == ERROR_ACCESS_DENIED) {
+            m_param->window.clear();
+            connect(*m_param);
+            SetLastError(ERROR_ACCESS_DENIED);
+            return false;
+        }
+        return true;
+    }
+
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+    /// <summary>
+    /// Injects faults into sent messages, right before they're written. Pass
+    /// nullptr to stop. Heartbeats are left alone.
+    /// </summary>
+    void set_fault_injector(std::shared_ptr<fault_injector> faults)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->mutex };
+        m_param->faults = std::move(faults);
+    }
+#endif
+
+private:
+    struct thread_param;
+
+    bool send_message(uint32_t topic, const void* buffer, DWORD size, deadline_t deadline)
+    {
+        if (!m_param)
+            return false;
+
+        WIN_PIPE_PROBE("SendStart", TraceLoggingUInt32(size, "bytes"));
+        bool tracing = details::tracing_enabled();
+        uint64_t send_begin = tracing || m_param->stats ? tsc_clock::now() : 0;
+
+        details::message_header header {};
+        header.deadline = deadline.time_since_epoch().count();
+
+        std::lock_guard lock { m_param->mutex };
+        if (topic != 0 && !wanted(*m_param, topic)) {
+            details::bump(m_param->unwanted_count, 1);
+            return true;
+        }
+
+        bool acknowledged = !m_param->window.empty();
+        if (acknowledged && !make_room(*m_param))
+            return false;
+
+        auto& message = m_param->buffer;
+        header.sequence = ++m_param->sequence;
+        header.sent_at = tsc_clock::now();
+        header.topic = topic;
+        if (acknowledged)
+            header.flags = details::message_flags::ack_requested;
+        details::frame_message(message, header, buffer, size);
+
+        DWORD write_size = (DWORD)message.size();
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+        write_size = inject_fault(*m_param, message);
+#endif
+        bool success = true;
+        if (acknowledged) {
+            // The old contents of the slot were acknowledged long ago, and
+            // make do as the next message's buffer.
+            auto& retained = m_param->window[header.sequence % m_param->window.size()];
+            std::swap(retained, message);
+            write_retained(*m_param, retained.data(), write_size);
+        }
+        else {
+            success = write(*m_param, message.data(), write_size);
+        }
+        uint64_t send_end = tracing || m_param->stats ? tsc_clock::now() : 0;
+        if (success)
+            details::count_message(m_param->stats.get(), size, send_end - send_begin);
+        if (tracing) {
+            details::trace("enqueue", send_begin, header.sent_at, size);
+            details::trace("write", header.sent_at, send_end, size);
+        }
+
+        WIN_PIPE_PROBE("SendEnd", TraceLoggingUInt32(size, "bytes"), TraceLoggingBool(success, "success"));
+        return success;
+    }
+
+    /// <summary>
+    /// Whether the receiver wants messages with the topic, as far as it has
+    /// told this sender. Until it has, it gets everything.
+    /// </summary>
+    static bool wanted(thread_param& param, uint32_t topic)
+    {
+        if (!param.readable || !param.pipe)
+            return true;
+
+        // Peeking is a system call, so it's done at most every 100ms, except
+        // right after connecting, while the topics are still on their way.
+        ULONGLONG now = GetTickCount64();
+        bool settling = !param.topics_known && now - param.connected_at < 100;
+        if (settling || now - param.last_poll >= 100) {
+            param.last_poll = now;
+            read_control(param, false);
+        }
+
+        const auto& topics = param.topics;
+        return topics.empty() || std::binary_search(topics.begin(), topics.end(), topic);
+    }
+
+    /// <summary>
+    /// The background thread connects (for connect_mode::async) and then
+    /// sends heartbeats (if enabled). It only runs while there's something
+    /// for it to do.
+    /// </summary>
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+        auto event = param->event.get();
+        DWORD interval = param->heartbeat_interval;
+
+        if (param->connect_async && !connect_in_background(*param))
+            return TRUE;
+
+        if (interval == 0)
+            return TRUE;
+
+        details::message_header header {};
+        header.flags = details::message_flags::heartbeat;
+
+        DWORD timeout = interval;
+        while (WaitForSingleObject(event, timeout) == WAIT_TIMEOUT) {
+            ULONGLONG idle = GetTickCount64() - param->last_write.load(std::memory_order_relaxed);
+            if (idle < interval) {
+                timeout = (DWORD)(interval - idle);
+                continue;
+            }
+            timeout = interval;
+
+            // If a send is in progress, then there's no need for a heartbeat.
+            std::unique_lock lock { param->mutex, std::try_to_lock };
+            if (!lock || !param->pipe)
+                continue;
+
+            header.sent_at = tsc_clock::now();
+            write(*param, &header, sizeof(header));
+        }
+
+        return TRUE;
+    }
+
+    /// <summary>
+    /// Keeps trying to connect until it succeeds or the thread is stopped.
+    /// Returns false if stopped.
+    /// </summary>
+    static bool connect_in_background(thread_param& param)
+    {
+        auto event = param.event.get();
+
+        while (WaitForSingleObject(event, 0) == WAIT_TIMEOUT) {
+            DWORD error = 0;
+            {
+                std::lock_guard lock { param.mutex };
+                if (param.pipe || connect(param)) {
+                    param.connect_async = false;
+                    return true;
+                }
+                error = GetLastError();
+            }
+
+            // A busy pipe can be waited on directly, but one that doesn't
+            // exist yet can only be polled.
+            if (error == ERROR_PIPE_BUSY)
+                WaitNamedPipeA(param.name.c_str(), 50);
+            else
+                WaitForSingleObject(event, 50);
+        }
+
+        return false;
+    }
+
+    void restart_thread()
+    {
+        stop_thread();
+        if (m_param->heartbeat_interval == 0 && !m_param->connect_async)
+            return;
+
+        ResetEvent(m_param->event.get());
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    void stop_thread()
+    {
+        if (!m_thread)
+            return;
+
+        SetEvent(m_param->event.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_thread = nullptr;
+    }
+
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+    /// <summary>
+    /// Returns how much of the message to write.
+    /// </summary>
+    static DWORD inject_fault(thread_param& param, std::vector<uint8_t>& message)
+    {
+        if (!param.faults)
+            return (DWORD)message.size();
+
+        switch (param.faults->next()) {
+        case fault::disconnect:
+            // The write then fails on the closed handle and reconnects.
+            param.pipe = nullptr;
+            break;
+        case fault::partial_write:
+            return (DWORD)std::max<size_t>(message.size() / 2, sizeof(details::message_header));
+        case fault::delay:
+            Sleep((DWORD)param.faults->delay().count());
+            break;
+        case fault::oversize:
+            message.resize(message.size() + param.faults->oversize());
+            break;
+        default:
+            break;
+        }
+        return (DWORD)message.size();
+    }
+#endif
+
+    static bool write(thread_param& param, const void* buffer, DWORD size)
+    {
+        if (!write_once(param, buffer, size)) {
+            DWORD error = GetLastError();
+            switch (error) {
+            case ERROR_INVALID_HANDLE:
+            case ERROR_PIPE_NOT_CONNECTED:
+            case ERROR_NO_DATA:
+            case ERROR_BROKEN_PIPE:
+                WIN_PIPE_PROBE("Reconnect", TraceLoggingString(param.name.c_str(), "pipe"),
+                    TraceLoggingUInt32(error, "error"));
+                if (param.stats)
+                    details::bump(param.stats->reconnects, 1);
+                if (!connect(param))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+
+            if (!write_once(param, buffer, size))
+                return false;
+        }
+
+        if (param.peer_timeout == INFINITE)
+            FlushFileBuffers(param.pipe.get());
+
+        param.last_write.store(GetTickCount64(), std::memory_order_relaxed);
+        return true;
+    }
+
+    /// <summary>
+    /// Writes a message that's already in the window. There's no retrying
+    /// here, since reconnecting sends everything in the window again anyway.
+    /// </summary>
+    static void write_retained(thread_param& param, const void* buffer, DWORD size)
+    {
+        if (write_once(param, buffer, size)) {
+            param.last_write.store(GetTickCount64(), std::memory_order_relaxed);
+            return;
+        }
+
+        WIN_PIPE_PROBE("Reconnect", TraceLoggingString(param.name.c_str(), "pipe"),
+            TraceLoggingUInt32(GetLastError(), "error"));
+        if (param.stats)
+            details::bump(param.stats->reconnects, 1);
+        connect(param);
+    }
+
+    /// <summary>
+    /// Makes room in the window for one more message, if need be by waiting
+    /// for acknowledgements, or by reconnecting if the receiver went away.
+    /// Returns false if the window stays full.
+    /// </summary>
+    static bool make_room(thread_param& param)
+    {
+        uint64_t window = param.window.size();
+
+        // Most sends don't even look for acknowledgements.
+        if (param.sequence - param.acked < window / 2)
+            return true;
+
+        if (param.pipe)
+            read_control(param, false);
+
+        int reconnects = 0;
+        while (param.sequence - param.acked >= window) {
+            if (param.pipe && read_control(param, true))
+                continue;
+            if (reconnects++ == 3 || !connect(param))
+                return false;
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Reads whatever the receiver has sent back, and with wait set, waits up
+    /// to the peer timeout for at least one message. Returns false, dropping
+    /// the connection, if the pipe broke or the wait timed out.
+    /// </summary>
+    static bool read_control(thread_param& param, bool wait)
+    {
+        auto pipe = param.pipe.get();
+        auto& message = param.control;
+
+        while (true) {
+            DWORD available = 0;
+            DWORD next_size = 0;
+            if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, &next_size)) {
+                param.pipe = nullptr;
+                return false;
+            }
+            if (available == 0 && !wait)
+                return true;
+
+            message.resize(std::max<size_t>(next_size, sizeof(details::message_header)));
+            DWORD bytes_read = 0;
+            bool success = read_once(param, message.data(), (DWORD)message.size(), bytes_read);
+            if (!success && GetLastError() == ERROR_MORE_DATA) {
+                DWORD leftover = 0;
+                PeekNamedPipe(pipe, NULL, 0, NULL, NULL, &leftover);
+                message.resize(bytes_read + leftover);
+
+                DWORD more_bytes_read = 0;
+                success = read_once(param, message.data() + bytes_read, leftover, more_bytes_read);
+                bytes_read += more_bytes_read;
+            }
+            if (!success) {
+                param.pipe = nullptr;
+                return false;
+            }
+
+            on_control(param, message.data(), bytes_read);
+            wait = false;
+        }
+    }
+
+    static bool read_once(thread_param& param, uint8_t* data, DWORD size, DWORD& bytes_read)
+    {
+        auto pipe = param.pipe.get();
+
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = param.control_event.get();
+        BOOL started = ReadFile(pipe, data, size, NULL, &overlapped);
+        return details::finish_overlapped(pipe, overlapped, started, param.peer_timeout, bytes_read);
+    }
+
+    static void on_control(thread_param& param, const uint8_t* data, DWORD size)
+    {
+        details::message_header header;
+        if (size < sizeof(header))
+            return;
+        std::memcpy(&header, data, sizeof(header));
+
+        if (header.flags & details::message_flags::ack)
+            param.acked = std::clamp(header.sequence, param.acked, param.sequence);
+
+        if (header.flags & details::message_flags::topics) {
+            param.topics.resize((size - sizeof(header)) / sizeof(uint32_t));
+            if (!param.topics.empty())
+                std::memcpy(param.topics.data(), data + sizeof(header), param.topics.size() * sizeof(uint32_t));
+            param.topics_known = true;
+        }
+    }
+
+    /// <summary>
+    /// Starts a new connection of a sender with acknowledgements on: tells
+    /// the receiver who's connecting, then sends whatever is unacknowledged.
+    /// </summary>
+    static bool resume(thread_param& param)
+    {
+        details::message_header header {};
+        header.flags = details::message_flags::hello;
+        header.sent_at = tsc_clock::now();
+        details::hello_message hello { param.stream_id, (uint32_t)param.window.size(), 0 };
+        std::vector<uint8_t> message;
+        details::frame_message(message, header, &hello, sizeof(hello));
+        bool success = write_once(param, message.data(), (DWORD)message.size());
+
+        for (uint64_t sequence = param.acked + 1; success && sequence <= param.sequence; sequence++) {
+            const auto& retained = param.window[sequence % param.window.size()];
+            success = write_once(param, retained.data(), (DWORD)retained.size());
+        }
+
+        if (!success) {
+            param.pipe = nullptr;
+            return false;
+        }
+
+        param.last_write.store(GetTickCount64(), std::memory_order_relaxed);
+        return true;
+    }
+
+    static bool write_once(thread_param& param, const void* buffer, DWORD size)
+    {
+        auto pipe = param.pipe.get();
+
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = param.io_event.get();
+        if (WriteFile(pipe, buffer, size, NULL, &overlapped))
+            return true;
+        if (GetLastError() != ERROR_IO_PENDING)
+            return false;
+
+        DWORD bytes_written = 0;
+        if (WaitForSingleObject(overlapped.hEvent, param.peer_timeout) == WAIT_TIMEOUT) {
+            CancelIoEx(pipe, &overlapped);
+            GetOverlappedResult(pipe, &overlapped, &bytes_written, TRUE);
+
+            // Drop the connection, so the next send reconnects instead of
+            // getting stuck behind the same unresponsive receiver again.
+            param.pipe = nullptr;
+            SetLastError(ERROR_SEM_TIMEOUT);
+            return false;
+        }
+
+        return GetOverlappedResult(pipe, &overlapped, &bytes_written, FALSE);
+    }
+
+    static bool connect(thread_param& param)
+    {
+        // In order to CloseHandle before CreateFile, you need to destroy
+        // what's inside the unique_ptr by either calling reset() or assigning
+        // it nullptr.
+        param.pipe = nullptr;
+
+        // Pipes can only be opened, never created, by CreateFile, so
+        // OPEN_EXISTING is the only disposition that makes sense. If every
+        // instance is busy, this fails straight away with ERROR_PIPE_BUSY.
+        // Readable too, for the receiver to send back its topics and
+        // acknowledgements, unless it created the pipe inbound only because
+        // it never does.
+        HANDLE pipe = CreateFileA(param.name.c_str(), GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED,
+            NULL);
+        param.readable = pipe != INVALID_HANDLE_VALUE;
+        if (!param.readable && GetLastError() == ERROR_ACCESS_DENIED && param.window.empty()) {
+            pipe = CreateFileA(param.name.c_str(), GENERIC_WRITE,
+                FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED,
+                NULL);
+        }
+        WIN_PIPE_PROBE("Connect", TraceLoggingString(param.name.c_str(), "pipe"),
+            TraceLoggingBool(pipe != INVALID_HANDLE_VALUE, "success"));
+        if (pipe == INVALID_HANDLE_VALUE)
+            return false;
+
+        param.pipe.reset(pipe);
+        param.topics.clear();
+        param.topics_known = false;
+        param.connected_at = GetTickCount64();
+        if (param.readable) {
+            DWORD mode = PIPE_READMODE_MESSAGE;
+            SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+        }
+
+        return param.window.empty() || resume(param);
+    }
+
+private:
+    struct thread_param {
+        details::unique_handle pipe;
+        details::unique_handle event;
+        details::unique_handle io_event;
+        std::string name;
+        std::vector<uint8_t> buffer;
+        std::mutex mutex;
+        DWORD peer_timeout = INFINITE;
+        DWORD heartbeat_interval = 0;
+        bool connect_async = false;
+        std::atomic<ULONGLONG> last_write { 0 };
+        // Of the last message sent, guarded by mutex.
+        uint64_t sequence = 0;
+        // With acknowledgements on, messages acked + 1 to sequence, each in
+        // the slot for its sequence number modulo the window size. Guarded
+        // by mutex.
+        std::vector<std::vector<uint8_t>> window;
+        uint64_t acked = 0;
+        uint64_t stream_id = 0;
+        // What the receiver sends back, if the pipe is readable. Guarded by
+        // mutex.
+        bool readable = false;
+        details::unique_handle control_event;
+        std::vector<uint8_t> control;
+        // Sorted topic_ids, or empty for everything.
+        std::vector<uint32_t> topics;
+        bool topics_known = false;
+        ULONGLONG connected_at = 0;
+        ULONGLONG last_poll = 0;
+        std::atomic<uint64_t> unwanted_count { 0 };
+        details::unique_stats stats;
+#ifdef WIN_PIPE_ENABLE_FAULT_INJECTION
+        std::shared_ptr<fault_injector> faults;
+#endif
+    };
+
+private:
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+
+// -------------------------------------------------------------[ duplex_channel
+
+/// <summary>
+/// Both ends of a request/response conversation over a single pipe
+/// connection, instead of a receiver and a sender on each side. Each end can
+/// send at any time, and receives on a read thread of its own, so reads and
+/// writes never wait on each other.
+/// <para/>
+/// One end has to listen() and the other has to connect(). Only one
+/// connection at a time is accepted, same as receiver.
+/// </summary>
+class duplex_channel {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No pipe is opened/created, and no
+    /// read thread is started.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    duplex_channel() = default;
+
+    /// <summary>
+    /// Creates the pipe and waits in the background for the other end to
+    /// connect. Throws if the pipe can't be created.
+    /// </summary>
+    static duplex_channel listen(std::string_view name, callback_t callback)
+    {
+        duplex_channel channel;
+        channel.m_param = std::make_unique<thread_param>();
+        channel.m_param->listening = true;
+
+        std::string pipe_name { details::format_name(name) };
+        channel.m_param->pipe.reset(CreateNamedPipeA(
+            pipe_name.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+            1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL));
+        if (channel.m_param->pipe.get() == INVALID_HANDLE_VALUE) {
+            std::string msg { "Pipe creation failed: " };
+            msg += std::to_string(GetLastError());
+            throw std::runtime_error(msg);
+        }
+
+        channel.start(callback);
+        return channel;
+    }
+
+    /// <summary>
+    /// Connects to the end that called listen(), waiting in the background
+    /// until it exists, and reconnecting whenever the connection breaks.
+    /// </summary>
+    static duplex_channel connect(std::string_view name, callback_t callback)
+    {
+        duplex_channel channel;
+        channel.m_param = std::make_unique<thread_param>();
+        channel.m_param->name = details::format_name(name);
+        channel.start(callback);
+        return channel;
+    }
+
+    duplex_channel(duplex_channel&&) noexcept = default;
+
+    ~duplex_channel()
+    {
+        stop_thread();
+    }
+
+    duplex_channel& operator=(duplex_channel&& other) noexcept
+    {
+        if (this != &other) {
+            stop_thread();
+            m_param = std::move(other.m_param);
+            m_thread = std::move(other.m_thread);
+        }
+        return *this;
+    }
+
+    void set_callback(callback_t callback)
+    {
+        if (!m_param)
+            return;
+
+        std::lock_guard lock { m_param->callback_mutex };
+        m_param->callback = callback;
+    }
+
+    /// <summary>
+    /// Sends a message to the other end. Fails if the other end isn't
+    /// connected. Unlike sender::send, it doesn't wait for the other end to
+    /// read the message, only for it to fit in the pipe's buffer.
+    /// </summary>
+    bool send(const void* buffer, DWORD size)
+    {
+        return send(buffer, size, no_deadline);
+    }
+
+    /// <summary>
+    /// Same as sender::send with a deadline.
+    /// </summary>
+    bool send(const void* buffer, DWORD size, deadline_t deadline)
+    {
+        if (!m_param)
+            return false;
+
+        details::message_header header {};
+        header.deadline = deadline.time_since_epoch().count();
+
+        std::lock_guard lock { m_param->write_mutex };
+        if (!m_param->connected)
+            return false;
+
+        auto pipe = m_param->pipe.get();
+        auto& message = m_param->write_buffer;
+        details::frame_message(message, header, buffer, size);
+
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = m_param->write_event.get();
+        BOOL started = WriteFile(pipe, message.data(), (DWORD)message.size(), NULL, &overlapped);
+
+        DWORD bytes_written = 0;
+        return details::finish_overlapped(pipe, overlapped, started, INFINITE, bytes_written);
+    }
+
+    /// <summary>
+    /// Number of messages that were skipped without invoking the callback
+    /// because their deadline had already passed by the time they were read.
+    /// </summary>
+    uint64_t expired_count() const
+    {
+        if (!m_param)
+            return 0;
+
+        return m_param->expired_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct thread_param;
+
+    void start(callback_t callback)
+    {
+        m_param->callback = callback;
+        m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->read_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_param->write_event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+    }
+
+    void stop_thread()
+    {
+        if (!m_thread)
+            return;
+
+        SetEvent(m_param->event.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_thread = nullptr;
+    }
+
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+
+        OVERLAPPED overlapped {};
+        overlapped.hEvent = param->read_event.get();
+
+        std::vector<uint8_t> buffer(1024);
+
+        while (establish(*param, overlapped)) {
+            DWORD bytes_read = 0;
+            while (read_message(*param, overlapped, buffer, bytes_read)) {
+                details::message_header header;
+                if (!details::accept_message(buffer.data(), bytes_read, param->expired_count, header))
+                    continue;
+
+                constexpr size_t header_size = sizeof(details::message_header);
+                std::lock_guard lock { param->callback_mutex };
+                param->callback(buffer.data() + header_size, (size_t)bytes_read - header_size);
+            }
+
+            std::lock_guard lock { param->write_mutex };
+            param->connected = false;
+            if (param->listening)
+                DisconnectNamedPipe(param->pipe.get());
+            else
+                param->pipe = nullptr;
+        }
+
+        return TRUE;
+    }
+
+    /// <summary>
+    /// Waits for the other end to connect (when listening) or for the pipe
+    /// to become available (when connecting). Returns false if stopped.
+    /// </summary>
+    static bool establish(thread_param& param, OVERLAPPED& overlapped)
+    {
+        auto event = param.event.get();
+
+        while (WaitForSingleObject(event, 0) == WAIT_TIMEOUT) {
+            if (param.listening) {
+                auto pipe = param.pipe.get();
+                DWORD unused = 0;
+                BOOL started = ConnectNamedPipe(pipe, &overlapped);
+                if ((!started && GetLastError() == ERROR_PIPE_CONNECTED)
+                    || details::finish_overlapped(pipe, overlapped, started, event, unused)) {
+                    std::lock_guard lock { param.write_mutex };
+                    param.connected = true;
+                    return true;
+                }
+
+                // Most likely the other end connected and left again before
+                // the connection was accepted.
+                DisconnectNamedPipe(pipe);
+                continue;
+            }
+
+            HANDLE pipe = CreateFileA(param.name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+            if (pipe != INVALID_HANDLE_VALUE) {
+                DWORD mode = PIPE_READMODE_MESSAGE;
+                SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+
+                std::lock_guard lock { param.write_mutex };
+                param.pipe.reset(pipe);
+                param.connected = true;
+                return true;
+            }
+
+            // A busy pipe can be waited on directly, but one that doesn't
+            // exist yet can only be polled.
+            if (GetLastError() == ERROR_PIPE_BUSY)
+                WaitNamedPipeA(param.name.c_str(), 50);
+            else
+                WaitForSingleObject(event, 50);
+        }
+
+        return false;
+    }
+
+    static bool read_message(thread_param& param, OVERLAPPED& overlapped,
+        std::vector<uint8_t>& buffer, DWORD& bytes_read)
+    {
+        if (read(param, overlapped, buffer.data(), (DWORD)buffer.size(), bytes_read))
+            return true;
+        if (GetLastError() != ERROR_MORE_DATA)
+            return false;
+
+        DWORD leftover = 0;
+        PeekNamedPipe(param.pipe.get(), NULL, NULL, NULL, NULL, &leftover);
+        buffer.resize(bytes_read + leftover);
+
+        DWORD more_bytes_read = 0;
+        bool success = read(param, overlapped, buffer.data() + bytes_read, leftover, more_bytes_read);
+        bytes_read += more_bytes_read;
+        return success;
+    }
+
+    static bool read(thread_param& param, OVERLAPPED& overlapped,
+        uint8_t* data, DWORD size, DWORD& bytes_read)
+    {
+        auto pipe = param.pipe.get();
+
+        // A read that fills the buffer with more of the message left over
+        // has still completed, and signals the event.
+        BOOL started = ReadFile(pipe, data, size, NULL, &overlapped);
+        if (!started && GetLastError() == ERROR_MORE_DATA)
+            started = TRUE;
+
+        return details::finish_overlapped(pipe, overlapped, started, param.event.get(), bytes_read);
+    }
+
+private:
+    struct thread_param {
+        details::unique_handle pipe;
+        details::unique_handle event;
+        details::unique_handle read_event;
+        details::unique_handle write_event;
+        std::string name;
+        bool listening = false;
+        std::mutex callback_mutex;
+        callback_t callback;
+        std::mutex write_mutex;
+        std::vector<uint8_t> write_buffer;
+        bool connected = false;
+        std::atomic<uint64_t> expired_count { 0 };
+    };
+
+private:
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+
+// -------------------------------------------------------------------[ pipeline
+
+/// <summary>
+/// A received message, as seen by the first stage of a pipeline. Only valid
+/// until that stage returns, so map it to something that owns its data
+/// before an async stage or a batch.
+/// </summary>
+struct message_view {
+    uint8_t* data;
+    size_t size;
+};
+
+namespace details {
+    /// <summary>
+    /// A bounded single-producer single-consumer queue. The consumer spins
+    /// for a while when it runs dry, then sleeps until the producer wakes it.
+    /// A full queue makes the producer yield until there's room, which is
+    /// what pushes back on the stage upstream.
+    /// </summary>
+    template <typename T>
+    class spsc_queue {
+    public:
+        using value_type = T;
+
+        explicit spsc_queue(size_t capacity)
+        {
+            size_t rounded = 1;
+            while (rounded < capacity)
+                rounded <<= 1;
+            m_slots.resize(rounded);
+            m_mask = rounded - 1;
+            m_event.reset(CreateEventA(NULL, FALSE, FALSE, NULL));
+        }
+
+        void push(T&& value)
+        {
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+            while (tail - m_head.load(std::memory_order_acquire) > m_mask)
+                SwitchToThread();
+
+            m_slots[tail & m_mask] = std::move(value);
+            m_tail.store(tail + 1, std::memory_order_release);
+
+            // Pairs with the fence in pop, so that either the consumer sees
+            // the new tail or we see that it went to sleep.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false))
+                SetEvent(m_event.get());
+        }
+
+        /// <summary>
+        /// Returns false, without waiting, if the queue is empty.
+        /// </summary>
+        bool try_pop(T& value)
+        {
+            size_t head = m_head.load(std::memory_order_relaxed);
+            if (head == m_tail.load(std::memory_order_acquire))
+                return false;
+
+            value = std::move(m_slots[head & m_mask]);
+            m_head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// <summary>
+        /// Waits for a value. Returns false once stop has been called and the
+        /// queue is empty.
+        /// </summary>
+        bool pop(T& value)
+        {
+            for (int spins = 0; !try_pop(value); spins++) {
+                if (m_stopping.load(std::memory_order_acquire))
+                    return try_pop(value);
+
+                if (spins < spin_count) {
+                    YieldProcessor();
+                    continue;
+                }
+
+                m_sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (try_pop(value)) {
+                    m_sleeping.store(false, std::memory_order_relaxed);
+                    return true;
+                }
+                if (!m_stopping.load(std::memory_order_acquire))
+                    WaitForSingleObject(m_event.get(), INFINITE);
+                m_sleeping.store(false, std::memory_order_relaxed);
+                spins = 0;
+            }
+            return true;
+        }
+
+        void stop()
+        {
+            m_stopping.store(true, std::memory_order_release);
+            SetEvent(m_event.get());
+        }
+
+    private:
+        alignas(64) std::atomic<size_t> m_head { 0 };
+        alignas(64) std::atomic<size_t> m_tail { 0 };
+        alignas(64) std::atomic<bool> m_sleeping { false };
+        std::atomic<bool> m_stopping { false };
+        size_t m_mask = 0;
+        std::vector<T> m_slots;
+        unique_handle m_event;
+    };
+
+    // Every stage takes a value of type T and hands zero or more values on
+    // to next. They're plain structs, so a chain of them inlines into one
+    // loop.
+
+    template <typename T, typename F>
+    struct filter_stage {
+        F predicate;
+
+        template <typename Next>
+        void process(T&& value, Next&& next)
+        {
+            if (predicate(value))
+                next(std::move(value));
+        }
+    };
+
+    template <typename T, typename F>
+    struct map_stage {
+        F function;
+
+        template <typename Next>
+        void process(T&& value, Next&& next)
+        {
+            next(function(std::move(value)));
+        }
+    };
+
+    template <typename T>
+    struct batch_stage {
+        size_t size;
+        std::vector<T> batch;
+
+        template <typename Next>
+        void process(T&& value, Next&& next)
+        {
+            batch.push_back(std::move(value));
+            if (batch.size() >= size)
+                flush(next);
+        }
+
+        template <typename Next>
+        void flush(Next&& next)
+        {
+            if (batch.empty())
+                return;
+
+            std::vector<T> full;
+            full.reserve(size);
+            full.swap(batch);
+            next(std::move(full));
+        }
+    };
+
+    template <typename T>
+    struct async_stage {
+        static_assert(!std::is_same_v<T, message_view>,
+            "message_view doesn't own its data; map it to something that does before async");
+        static_assert(std::is_default_constructible_v<T> && std::is_move_assignable_v<T>,
+            "values passed through async are kept in a preallocated queue, so they have to be "
+            "default constructible and move assignable");
+
+        std::unique_ptr<spsc_queue<T>> queue;
+        unique_handle thread;
+
+        template <typename Next>
+        void process(T&& value, Next&&)
+        {
+            queue->push(std::move(value));
+        }
+    };
+
+    template <typename T, typename F>
+    struct dispatch_stage {
+        F function;
+
+        template <typename Next>
+        void process(T&& value, Next&&)
+        {
+            function(std::move(value));
+        }
+    };
+
+    template <typename Stage>
+    struct is_async_stage : std::false_type { };
+
+    template <typename T>
+    struct is_async_stage<async_stage<T>> : std::true_type { };
+
+    template <typename Stage>
+    struct is_batch_stage : std::false_type { };
+
+    template <typename T>
+    struct is_batch_stage<batch_stage<T>> : std::true_type { };
+
+    template <typename... Stages>
+    class pipeline_state {
+    public:
+        explicit pipeline_state(std::tuple<Stages...>&& stages)
+            : m_stages { std::move(stages) }
+        {
+            start<0>();
+        }
+
+        ~pipeline_state()
+        {
+            stop<0>();
+        }
+
+        template <size_t I, typename T>
+        void run(T&& value)
+        {
+            std::get<I>(m_stages).process(std::forward<T>(value), [this] (auto&& out) {
+                run<I + 1>(std::forward<decltype(out)>(out));
+            });
+        }
+
+        /// <summary>
+        /// Passes on partial batches from stage I onwards, up to the next
+        /// async stage, which belongs to another thread.
+        /// </summary>
+        template <size_t I>
+        void flush()
+        {
+            if constexpr (I < sizeof...(Stages)) {
+                using stage_t = std::tuple_element_t<I, std::tuple<Stages...>>;
+                if constexpr (is_batch_stage<stage_t>::value) {
+                    std::get<I>(m_stages).flush([this] (auto&& out) {
+                        run<I + 1>(std::forward<decltype(out)>(out));
+                    });
+                }
+                if constexpr (!is_async_stage<stage_t>::value)
+                    flush<I + 1>();
+            }
+        }
+
+    private:
+        template <size_t I>
+        void start()
+        {
+            if constexpr (I < sizeof...(Stages)) {
+                using stage_t = std::tuple_element_t<I, std::tuple<Stages...>>;
+                if constexpr (is_async_stage<stage_t>::value)
+                    std::get<I>(m_stages).thread.reset(CreateThread(NULL, 0, worker<I>, this, 0, NULL));
+                start<I + 1>();
+            }
+        }
+
+        /// <summary>
+        /// Upstream first, so that each thread finishes off its queue while
+        /// the threads after it are still there to take the results.
+        /// </summary>
+        template <size_t I>
+        void stop()
+        {
+            if constexpr (I < sizeof...(Stages)) {
+                using stage_t = std::tuple_element_t<I, std::tuple<Stages...>>;
+                if constexpr (is_async_stage<stage_t>::value) {
+                    auto& stage = std::get<I>(m_stages);
+                    stage.queue->stop();
+                    WaitForSingleObject(stage.thread.get(), INFINITE);
+                }
+                stop<I + 1>();
+            }
+        }
+
+        template <size_t I>
+        static DWORD WINAPI worker(LPVOID lp)
+        {
+            auto* self = reinterpret_cast<pipeline_state*>(lp);
+            auto& queue = *std::get<I>(self->m_stages).queue;
+
+            typename std::remove_reference_t<decltype(queue)>::value_type value {};
+            while (true) {
+                if (!queue.try_pop(value)) {
+                    // Out of input for now, so don't sit on partial batches.
+                    self->template flush<I + 1>();
+                    if (!queue.pop(value))
+                        break;
+                }
+                self->template run<I + 1>(std::move(value));
+            }
+
+            self->template flush<I + 1>();
+            return TRUE;
+        }
+
+        std::tuple<Stages...> m_stages;
+    };
+}
+
+/// <summary>
+/// A receive pipeline, built with pipeline_builder. Pass callback() to a
+/// receiver. The pipeline lives as long as either this object or any copy
+/// of the callback, and on destruction lets every async stage finish its
+/// queue.
+/// <para/>
+/// Note: the stages up to the first async one, and that stage's queue,
+/// expect a single producer. So the callback is handed out only once, and
+/// must only be given to one receiver (or multi_receiver, or
+/// pooled_receiver), never called from two threads at once.
+/// </summary>
+template <typename... Stages>
+class pipeline {
+public:
+    explicit pipeline(std::tuple<Stages...>&& stages)
+        : m_state { std::make_shared<details::pipeline_state<Stages...>>(std::move(stages)) }
+    {
+    }
+
+    /// <summary>
+    /// Throws if called more than once, since two receivers feeding one
+    /// pipeline would be two producers.
+    /// </summary>
+    callback_t callback()
+    {
+        if (m_handed_out)
+            throw std::runtime_error("Pipeline callback already handed out.");
+        m_handed_out = true;
+
+        return [state = m_state] (uint8_t* data, size_t size) {
+            state->template run<0>(message_view { data, size });
+        };
+    }
+
+    /// <summary>
+    /// Passes on partial batches in the stages before the first async stage.
+    /// Those after it are passed on whenever their thread runs out of input.
+    /// Must not be called while a receiver is running the callback.
+    /// </summary>
+    void flush()
+    {
+        m_state->template flush<0>();
+    }
+
+private:
+    std::shared_ptr<details::pipeline_state<Stages...>> m_state;
+    bool m_handed_out = false;
+};
+
+/// <summary>
+/// Builds a pipeline one stage at a time. T is the type of value the next
+/// stage receives; the first stage receives message_view. Every stage runs
+/// on the receiver's read thread, fused into a single call, except after
+/// async, which hands values over to a thread of its own.
+/// <code>
+/// auto orders = pipeline_builder {}
+///     .filter([] (message_view m) { return m.size == sizeof(order); })
+///     .map([] (message_view m) { return *reinterpret_cast&lt;order*&gt;(m.data); })
+///     .async()
+///     .batch(64)
+///     .dispatch([] (std::vector&lt;order&gt; batch) { book.apply(batch); });
+/// receiver r { "orders", orders.callback() };
+/// </code>
+/// </summary>
+template <typename T = message_view, typename... Stages>
+class pipeline_builder {
+public:
+    pipeline_builder() = default;
+
+    explicit pipeline_builder(std::tuple<Stages...>&& stages)
+        : m_stages { std::move(stages) }
+    {
+    }
+
+    /// <summary>
+    /// Drops values the predicate returns false for.
+    /// </summary>
+    template <typename F>
+    auto filter(F predicate) &&
+    {
+        return append<T>(details::filter_stage<T, F> { std::move(predicate) });
+    }
+
+    /// <summary>
+    /// Replaces each value with what the function returns for it.
+    /// </summary>
+    template <typename F>
+    auto map(F function) &&
+    {
+        using result_t = std::decay_t<std::invoke_result_t<F&, T&&>>;
+        return append<result_t>(details::map_stage<T, F> { std::move(function) });
+    }
+
+    /// <summary>
+    /// Collects values into a std::vector, passed on once it has size values,
+    /// or earlier if the thread it runs on goes idle.
+    /// </summary>
+    auto batch(size_t size) &&
+    {
+        return append<std::vector<T>>(details::batch_stage<T> { size, {} });
+    }
+
+    /// <summary>
+    /// Runs the rest of the pipeline on a new thread, fed through a queue of
+    /// the given capacity. When the queue is full, the stages before it wait.
+    /// Values have to be default constructible, since the queue is allocated
+    /// up front.
+    /// </summary>
+    auto async(size_t capacity = 1024) &&
+    {
+        return append<T>(details::async_stage<T> {
+            std::make_unique<details::spsc_queue<T>>(capacity), nullptr });
+    }
+
+    /// <summary>
+    /// Ends the pipeline with a function that consumes each value.
+    /// </summary>
+    template <typename F>
+    auto dispatch(F function) &&
+    {
+        using stage_t = details::dispatch_stage<T, F>;
+        return pipeline<Stages..., stage_t> {
+            std::tuple_cat(std::move(m_stages), std::tuple<stage_t> { stage_t { std::move(function) } })
+        };
+    }
+
+private:
+    template <typename U, typename Stage>
+    pipeline_builder<U, Stages..., Stage> append(Stage&& stage)
+    {
+        return pipeline_builder<U, Stages..., Stage> {
+            std::tuple_cat(std::move(m_stages), std::tuple<Stage> { std::move(stage) })
+        };
+    }
+
+    std::tuple<Stages...> m_stages;
+};
+
+// ------------------------------------------------------------------------[ rpc
+
+/// <summary>
+/// Handles one call. Writes the response (at most capacity bytes) and returns
+/// its size.
+/// </summary>
+using rpc_handler_t = std::function<size_t(const uint8_t* request, size_t size,
+    uint8_t* response, size_t capacity)>;
+
+namespace details {
+    struct rpc_header {
+        uint32_t slot_count;
+        uint32_t slot_size;
+        DWORD server_pid;
+        std::atomic<uint32_t> server_sleeping;
+        // Set last, once the slots and events exist.
+        std::atomic<uint32_t> ready;
+    };
+
+    // How long a client waits for a server that's still starting up.
+    inline constexpr ULONGLONG rpc_startup_timeout = 1000;
+
+    struct alignas(64) rpc_slot {
+        enum : uint32_t {
+            idle,
+            request,
+            response,
+        };
+
+        std::atomic<DWORD> owner;
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> client_waiting;
+        uint32_t request_size;
+        uint32_t response_size;
+        // Followed by slot_size bytes of request, then slot_size bytes of
+        // response.
+    };
+
+    static inline size_t rpc_slot_stride(size_t slot_size)
+    {
+        return (sizeof(rpc_slot) + 2 * slot_size + 63) & ~(size_t)63;
+    }
+
+    static inline rpc_slot* rpc_slot_at(void* view, size_t index, size_t slot_size)
+    {
+        auto* slots = reinterpret_cast<uint8_t*>(view) + sizeof(rpc_header);
+        slots += (alignof(rpc_slot) - sizeof(rpc_header) % alignof(rpc_slot)) % alignof(rpc_slot);
+        return reinterpret_cast<rpc_slot*>(slots + index * rpc_slot_stride(slot_size));
+    }
+
+    static inline size_t rpc_segment_size(size_t slot_count, size_t slot_size)
+    {
+        return sizeof(rpc_header) + alignof(rpc_slot) + slot_count * rpc_slot_stride(slot_size);
+    }
+
+    static inline std::string format_rpc_event_name(std::string_view name, size_t slot)
+    {
+        std::string formatted = format_object_name("rpc", name);
+        formatted += "_event_";
+        formatted += std::to_string(slot);
+        return formatted;
+    }
+}
+
+/// <summary>
+/// Serves synchronous calls from rpc_clients in other processes on the same
+/// machine, through shared memory instead of pipes. Each client gets a slot
+/// holding one request and one response, and both sides spin for a few
+/// microseconds before falling back to sleeping on an event, so back-to-back
+/// calls never go through the kernel.
+/// <para/>
+/// Calls are handled one at a time on the server's own thread. While idle,
+/// that thread sleeps.
+/// </summary>
+class rpc_server {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. No shared memory is created, and no
+    /// thread is started.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    rpc_server() = default;
+
+    /// <summary>
+    /// Throws if the shared memory can't be created, or another server with
+    /// the same name already exists. Requests and responses larger than
+    /// slot_size bytes are rejected.
+    /// </summary>
+    rpc_server(std::string_view name, rpc_handler_t handler,
+        size_t max_clients = 8, size_t slot_size = 4096)
+    {
+        m_param = std::make_unique<thread_param>();
+        m_param->handler = handler;
+        m_param->slot_count = max_clients;
+        m_param->slot_size = slot_size;
+
+        m_param->view = details::map_shared_memory(details::format_object_name("rpc", name),
+            details::rpc_segment_size(max_clients, slot_size), true, m_param->mapping);
+
+        auto* header = new (m_param->view.get()) details::rpc_header {};
+        header->slot_count = (uint32_t)max_clients;
+        header->slot_size = (uint32_t)slot_size;
+        header->server_pid = GetCurrentProcessId();
+
+        // Event 0 wakes the server up; event i + 1 wakes up the client in slot i.
+        for (size_t i = 0; i <= max_clients; i++) {
+            std::string event_name { details::format_rpc_event_name(name, i) };
+            m_param->events.emplace_back(CreateEventA(NULL, FALSE, FALSE, event_name.c_str()));
+            if (i < max_clients)
+                new (details::rpc_slot_at(m_param->view.get(), i, slot_size)) details::rpc_slot {};
+        }
+
+        m_param->event.reset(CreateEventA(NULL, TRUE, FALSE, NULL));
+        m_thread.reset(CreateThread(NULL, NULL, thread, m_param.get(), 0, NULL));
+        header->ready.store(1);
+    }
+
+    rpc_server(rpc_server&&) noexcept = default;
+
+    ~rpc_server()
+    {
+        stop_thread();
+    }
+
+    rpc_server& operator=(rpc_server&& other) noexcept
+    {
+        if (this != &other) {
+            stop_thread();
+            m_param = std::move(other.m_param);
+            m_thread = std::move(other.m_thread);
+        }
+        return *this;
+    }
+
+private:
+    struct thread_param;
+
+    void stop_thread()
+    {
+        if (!m_thread)
+            return;
+
+        m_param->stopping.store(true, std::memory_order_relaxed);
+        SetEvent(m_param->event.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+        m_thread = nullptr;
+    }
+
+    static DWORD WINAPI thread(LPVOID lp)
+    {
+        auto* param = reinterpret_cast<thread_param*>(lp);
+        auto* header = reinterpret_cast<details::rpc_header*>(param->view.get());
+        HANDLE handles[] { param->event.get(), param->events[0].get() };
+
+        int idle_spins = 0;
+        while (!param->stopping.load(std::memory_order_relaxed)) {
+            if (serve(param)) {
+                idle_spins = 0;
+                continue;
+            }
+
+            if (++idle_spins < details::spin_count) {
+                YieldProcessor();
+                continue;
+            }
+
+            // Announce going to sleep before looking one last time, so that a
+            // client either sees the flag and wakes us, or we see its request.
+            header->server_sleeping.store(1);
+            if (!serve(param))
+                WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+            header->server_sleeping.store(0);
+            idle_spins = 0;
+        }
+
+        return TRUE;
+    }
+
+    /// <summary>
+    /// Handles every pending request. Returns whether there were any.
+    /// </summary>
+    static bool serve(thread_param* param)
+    {
+        bool served = false;
+        for (size_t i = 0; i < param->slot_count; i++) {
+            auto* slot = details::rpc_slot_at(param->view.get(), i, param->slot_size);
+            if (slot->state.load(std::memory_order_acquire) != details::rpc_slot::request)
+                continue;
+
+            // Written by another process, so it's not taken on trust. A
+            // request that doesn't fit in the slot gets an empty response.
+            auto* request = reinterpret_cast<uint8_t*>(slot + 1);
+            auto* response = request + param->slot_size;
+            size_t request_size = slot->request_size;
+            size_t size = 0;
+            if (request_size <= param->slot_size)
+                size = param->handler(request, request_size, response, param->slot_size);
+            slot->response_size = (uint32_t)std::min<size_t>(size, param->slot_size);
+
+            slot->state.store(details::rpc_slot::response);
+            if (slot->client_waiting.exchange(0))
+                SetEvent(param->events[i + 1].get());
+
+            served = true;
+        }
+        return served;
+    }
+
+private:
+    struct thread_param {
+        details::unique_handle mapping;
+        details::unique_view view;
+        details::unique_handle event;
+        std::vector<details::unique_handle> events;
+        std::atomic<bool> stopping { false };
+        size_t slot_count = 0;
+        size_t slot_size = 0;
+        rpc_handler_t handler;
+    };
+
+private:
+    std::unique_ptr<thread_param> m_param;
+    details::unique_handle m_thread;
+};
+
+/// <summary>
+/// Makes synchronous calls to an rpc_server in another process. Each client
+/// holds on to one of the server's slots for as long as it exists. Calls from
+/// several threads on the same client are serialized.
+/// </summary>
+class rpc_client {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. Cannot actually make calls.
+    /// <para />
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    rpc_client() = default;
+
+    /// <summary>
+    /// Throws if there's no server with the given name, or all of its slots
+    /// are taken. Slots left behind by clients that have exited are reused.
+    /// A server that's still starting up is waited for, briefly.
+    /// </summary>
+    rpc_client(std::string_view name)
+    {
+        m_param = std::make_unique<param>();
+        m_param->view = details::map_shared_memory(details::format_object_name("rpc", name),
+            0, false, m_param->mapping);
+
+        auto* header = reinterpret_cast<details::rpc_header*>(m_param->view.get());
+        ULONGLONG deadline = GetTickCount64() + details::rpc_startup_timeout;
+        while (!header->ready.load(std::memory_order_acquire)) {
+            if (GetTickCount64() >= deadline)
+                throw std::runtime_error("RPC server didn't start.");
+            Sleep(1);
+        }
+
+        m_param->slot_size = header->slot_size;
+        m_param->server.reset(OpenProcess(SYNCHRONIZE, FALSE, header->server_pid));
+
+        DWORD pid = GetCurrentProcessId();
+        for (size_t i = 0; i < header->slot_count && !m_param->slot; i++) {
+            auto* slot = details::rpc_slot_at(m_param->view.get(), i, m_param->slot_size);
+            DWORD owner = slot->owner.load();
+            if ((owner == 0 || !is_alive(owner)) && slot->owner.compare_exchange_strong(owner, pid)) {
+                slot->state.store(details::rpc_slot::idle);
+                slot->client_waiting.store(0);
+                m_param->slot = slot;
+                m_param->index = i;
+            }
+        }
+        if (!m_param->slot)
+            throw std::runtime_error("No free RPC slots.");
+
+        std::string server_event { details::format_rpc_event_name(name, 0) };
+        std::string slot_event { details::format_rpc_event_name(name, m_param->index + 1) };
+        m_param->server_event.reset(OpenEventA(EVENT_MODIFY_STATE, FALSE, server_event.c_str()));
+        m_param->event.reset(OpenEventA(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, slot_event.c_str()));
+        if (!m_param->server_event || !m_param->event) {
+            std::string msg { "Failed to open RPC events: " };
+            msg += std::to_string(GetLastError());
+            m_param->slot->owner.store(0);
+            throw std::runtime_error(msg);
+        }
+    }
+
+    rpc_client(rpc_client&&) noexcept = default;
+
+    ~rpc_client()
+    {
+        release_slot();
+    }
+
+    rpc_client& operator=(rpc_client&& other) noexcept
+    {
+        if (this != &other) {
+            release_slot();
+            m_param = std::move(other.m_param);
+        }
+        return *this;
+    }
+
+    /// <summary>
+    /// Sends the request and waits for the server's response. Fails if the
+    /// request is larger than the server's slot size, or the server exits
+    /// before responding.
+    /// </summary>
+    bool call(const void* request, DWORD size, std::vector<uint8_t>& response)
+    {
+        if (!m_param || size > m_param->slot_size)
+            return false;
+
+        std::lock_guard lock { m_param->mutex };
+        auto* slot = m_param->slot;
+        auto* header = reinterpret_cast<details::rpc_header*>(m_param->view.get());
+        auto* request_data = reinterpret_cast<uint8_t*>(slot + 1);
+        auto* response_data = request_data + m_param->slot_size;
+
+        std::memcpy(request_data, request, size);
+        slot->request_size = size;
+        slot->state.store(details::rpc_slot::request);
+        if (header->server_sleeping.load())
+            SetEvent(m_param->server_event.get());
+
+        if (!wait_for_response()) {
+            // Only happens once the server is gone, so no response can turn
+            // up late and be mistaken for the next call's.
+            slot->client_waiting.store(0, std::memory_order_relaxed);
+            slot->state.store(details::rpc_slot::idle);
+            return false;
+        }
+
+        size_t response_size = std::min<size_t>(slot->response_size, m_param->slot_size);
+        response.assign(response_data, response_data + response_size);
+        slot->state.store(details::rpc_slot::idle, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    static bool is_alive(DWORD pid)
+    {
+        return !details::process_exited(pid);
+    }
+
+    void release_slot()
+    {
+        if (m_param && m_param->slot)
+            m_param->slot->owner.store(0);
+    }
+
+    bool wait_for_response()
+    {
+        auto* slot = m_param->slot;
+
+        for (int i = 0; i < details::spin_count; i++) {
+            if (slot->state.load(std::memory_order_acquire) == details::rpc_slot::response)
+                return true;
+            YieldProcessor();
+        }
+
+        // Same handshake as the server going to sleep, but the other way
+        // around. Without a handle to the server process (e.g. no access to
+        // it), whether it's still there is checked every so often instead.
+        auto* header = reinterpret_cast<details::rpc_header*>(m_param->view.get());
+        HANDLE handles[] { m_param->event.get(), m_param->server.get() };
+        DWORD count = m_param->server ? 2 : 1;
+        DWORD timeout = m_param->server ? INFINITE : 100;
+        while (true) {
+            slot->client_waiting.store(1);
+            if (slot->state.load() == details::rpc_slot::response)
+                break;
+
+            DWORD result = WaitForMultipleObjects(count, handles, FALSE, timeout);
+            if (result == WAIT_TIMEOUT && !details::process_exited(header->server_pid))
+                continue;
+            if (result != WAIT_OBJECT_0)
+                return false;
+        }
+        slot->client_waiting.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    struct param {
+        details::unique_handle mapping;
+        details::unique_view view;
+        details::unique_handle server;
+        details::unique_handle server_event;
+        details::unique_handle event;
+        details::rpc_slot* slot = nullptr;
+        size_t index = 0;
+        size_t slot_size = 0;
+        std::mutex mutex;
+    };
+
+private:
+    std::unique_ptr<param> m_param;
+};
+
+// ----------------------------------------------------------------[ buffer_pool
+
+namespace details {
+    struct pool_header {
+        uint32_t block_size;
+        uint32_t block_count;
+        // Low 32 bits are the index of the first free block, high 32 bits are
+        // bumped on every change so that a stale compare-exchange fails (ABA).
+        std::atomic<uint64_t> free_head;
+        // Followed by a pool_link per block, then the blocks themselves.
+    };
+
+    struct pool_link {
+        // Index of the next free block.
+        std::atomic<uint32_t> next;
+        // 1 while the block is allocated, so that releasing it twice can't put
+        // it on the free list twice.
+        std::atomic<uint32_t> allocated;
+    };
+
+    static inline size_t pool_blocks_offset(size_t block_count)
+    {
+        return (sizeof(pool_header) + block_count * sizeof(pool_link) + 63) & ~(size_t)63;
+    }
+
+    inline constexpr uint32_t no_block = 0xFFFFFFFF;
+
+    /// <summary>
+    /// Pops a block index off a lock-free free list, where nodes[i].next holds
+    /// the index of the block after block i. Returns no_block if the list is
+    /// empty.
+    /// </summary>
+    template <class Node>
+    static inline uint32_t free_list_pop(std::atomic<uint64_t>& free_head, Node* nodes)
+    {
+        uint64_t head = free_head.load(std::memory_order_acquire);
+        while ((uint32_t)head != no_block) {
+            uint32_t index = (uint32_t)head;
+            uint64_t desired = (((head >> 32) + 1) << 32)
+                | nodes[index].next.load(std::memory_order_relaxed);
+            if (free_head.compare_exchange_weak(head, desired,
+                    std::memory_order_acquire, std::memory_order_acquire))
+                return index;
+        }
+        return no_block;
+    }
+
+    template <class Node>
+    static inline void free_list_push(std::atomic<uint64_t>& free_head, uint32_t index, Node* nodes)
+    {
+        uint64_t head = free_head.load(std::memory_order_relaxed);
+        uint64_t desired;
+        do {
+            nodes[index].next.store((uint32_t)head, std::memory_order_relaxed);
+            desired = (((head >> 32) + 1) << 32) | index;
+        } while (!free_head.compare_exchange_weak(head, desired,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+}
+
+/// <summary>
+/// Fixed-size blocks of shared memory, for passing large buffers between
+/// processes without copying them. The producer allocates a block, fills it
+/// in, and sends only its index (e.g. through a sender). The consumer looks
+/// the block up by index, uses it in place, and releases it, which puts it
+/// straight back on the producer's free list. The free list is lock-free, so
+/// either side can allocate or release at any time.
+/// </summary>
+class buffer_pool {
+public:
+    static constexpr uint32_t npos = details::no_block;
+
+    /// <summary>
+    /// Default constructor. Does nothing. Has no blocks.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    buffer_pool() = default;
+
+    /// <summary>
+    /// Creates a pool of block_count blocks, each at least block_size bytes
+    /// (rounded up to a cache line). Throws if it can't be created, or already
+    /// exists.
+    /// </summary>
+    static buffer_pool create(std::string_view name, size_t block_size, size_t block_count)
+    {
+        block_size = (block_size + 63) & ~(size_t)63;
+
+        buffer_pool pool;
+        pool.map(name, details::pool_blocks_offset(block_count) + block_size * block_count, true);
+
+        auto* header = new (pool.m_param->header) details::pool_header {};
+        header->block_size = (uint32_t)block_size;
+        header->block_count = (uint32_t)block_count;
+        pool.locate();
+
+        for (uint32_t i = 0; i < block_count; i++)
+            new (&pool.m_param->links[i]) details::pool_link { i + 1 < block_count ? i + 1 : npos, 0 };
+        header->free_head.store(block_count > 0 ? 0 : npos);
+
+        return pool;
+    }
+
+    /// <summary>
+    /// Opens a pool created by another process. Throws if it doesn't exist.
+    /// </summary>
+    static buffer_pool open(std::string_view name)
+    {
+        buffer_pool pool;
+        pool.map(name, 0, false);
+        pool.locate();
+        return pool;
+    }
+
+    /// <summary>
+    /// Takes a block off the free list. Returns nullptr if all of them are in
+    /// use.
+    /// </summary>
+    uint8_t* allocate()
+    {
+        if (!m_param)
+            return nullptr;
+
+        uint32_t index = details::free_list_pop(m_param->header->free_head, m_param->links);
+        if (index != npos)
+            m_param->links[index].allocated.store(1, std::memory_order_relaxed);
+        return block(index);
+    }
+
+    /// <summary>
+    /// Puts a block back on the free list. Can be called from any process
+    /// that has the pool open, not just the one that allocated it. Returns
+    /// false, and does nothing, for a block that isn't allocated, e.g. one
+    /// that was already released.
+    /// </summary>
+    bool release(const uint8_t* block)
+    {
+        uint32_t index = index_of(block);
+        if (index == npos)
+            return false;
+
+        uint32_t allocated = 1;
+        if (!m_param->links[index].allocated.compare_exchange_strong(allocated, 0))
+            return false;
+
+        details::free_list_push(m_param->header->free_head, index, m_param->links);
+        return true;
+    }
+
+    /// <summary>
+    /// The index to send to the other process in place of the block itself.
+    /// Returns npos for anything that isn't a block in this pool.
+    /// </summary>
+    uint32_t index_of(const uint8_t* block) const
+    {
+        if (!m_param || block < m_param->blocks)
+            return npos;
+
+        size_t offset = (size_t)(block - m_param->blocks);
+        size_t index = offset / m_param->header->block_size;
+        if (index >= m_param->header->block_count)
+            return npos;
+
+        return (uint32_t)index;
+    }
+
+    /// <summary>
+    /// Looks up a block by index. Returns nullptr for an invalid index.
+    /// </summary>
+    uint8_t* block(uint32_t index) const
+    {
+        if (!m_param || index >= m_param->header->block_count)
+            return nullptr;
+
+        return m_param->blocks + (size_t)index * m_param->header->block_size;
+    }
+
+    size_t block_size() const
+    {
+        return m_param ? m_param->header->block_size : 0;
+    }
+
+private:
+    void map(std::string_view name, size_t size, bool create)
+    {
+        m_param = std::make_unique<param>();
+        m_param->view = details::map_shared_memory(details::format_object_name("pool", name),
+            size, create, m_param->mapping);
+        m_param->header = reinterpret_cast<details::pool_header*>(m_param->view.get());
+    }
+
+    void locate()
+    {
+        auto* base = reinterpret_cast<uint8_t*>(m_param->view.get());
+        m_param->links = reinterpret_cast<details::pool_link*>(base + sizeof(details::pool_header));
+        m_param->blocks = base + details::pool_blocks_offset(m_param->header->block_count);
+    }
+
+private:
+    struct param {
+        details::unique_handle mapping;
+        details::unique_view view;
+        details::pool_header* header = nullptr;
+        details::pool_link* links = nullptr;
+        uint8_t* blocks = nullptr;
+    };
+
+private:
+    std::unique_ptr<param> m_param;
+};
+
+// ---------------------------------------------------------------[ payload_pool
+
+namespace details {
+    inline constexpr size_t max_subscribers = 64;
+
+    // Marks a subscriber slot whose dead owner is being cleaned up after.
+    inline constexpr DWORD reclaiming = 0xFFFFFFFF;
+
+    struct payload_pool_header {
+        uint32_t block_size;
+        uint32_t block_count;
+        std::atomic<uint64_t> free_head;
+        std::atomic<DWORD> subscribers[max_subscribers];
+        // Creation time of each subscriber's process, so that another process
+        // reusing its pid isn't mistaken for it. 0 while unknown.
+        std::atomic<uint64_t> created_at[max_subscribers];
+        // Followed by a payload_block per block, then the blocks themselves.
+    };
+
+    struct payload_block {
+        // One bit per subscriber still holding on to the block. Doubles as
+        // the reference count; the block is freed when it reaches zero.
+        std::atomic<uint64_t> holders;
+        std::atomic<uint32_t> next;
+        uint32_t size;
+    };
+
+    static inline size_t payload_blocks_offset(size_t block_count)
+    {
+        return (sizeof(payload_pool_header) + block_count * sizeof(payload_block) + 63)
+            & ~(size_t)63;
+    }
+}
+
+/// <summary>
+/// Shared memory blocks for broadcasting one payload to many subscribers
+/// without copying it for each. The publisher writes a block once and
+/// share()s it with every subscriber currently registered, then sends them
+/// all its index. Each subscriber reads it in place and releases it, and the
+/// block is freed once the last one does.
+/// <para/>
+/// Subscribers that crash can't release anything, so the publisher finds
+/// their leftovers in reclaim(), which allocate() also does by itself when
+/// the pool runs dry. Up to 64 subscribers at once.
+/// </summary>
+class payload_pool {
+public:
+    static constexpr uint32_t npos = details::no_block;
+
+    /// <summary>
+    /// Default constructor. Does nothing. Has no blocks.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    payload_pool() = default;
+
+    /// <summary>
+    /// For the publisher. Creates block_count blocks, each at least block_size
+    /// bytes. Throws if the pool can't be created, or already exists.
+    /// </summary>
+    static payload_pool create(std::string_view name, size_t block_size, size_t block_count)
+    {
+        block_size = (block_size + 63) & ~(size_t)63;
+
+        payload_pool pool;
+        pool.map(name, details::payload_blocks_offset(block_count) + block_size * block_count, true);
+
+        auto* header = new (pool.m_param->header) details::payload_pool_header {};
+        header->block_size = (uint32_t)block_size;
+        header->block_count = (uint32_t)block_count;
+        pool.locate();
+
+        for (uint32_t i = 0; i < block_count; i++) {
+            auto* block = new (&pool.m_param->meta[i]) details::payload_block {};
+            block->next.store(i + 1 < block_count ? i + 1 : npos);
+        }
+        header->free_head.store(block_count > 0 ? 0 : npos);
+
+        return pool;
+    }
+
+    /// <summary>
+    /// For subscribers. Opens a pool created by the publisher and registers
+    /// to receive everything shared from then on. Throws if the pool doesn't
+    /// exist, or already has 64 subscribers.
+    /// </summary>
+    static payload_pool subscribe(std::string_view name)
+    {
+        payload_pool pool;
+        pool.map(name, 0, false);
+        pool.locate();
+
+        DWORD pid = GetCurrentProcessId();
+        uint64_t created_at = details::process_created_at(GetCurrentProcess());
+        auto* header = pool.m_param->header;
+        for (size_t i = 0; i < details::max_subscribers; i++) {
+            DWORD owner = header->subscribers[i].load();
+            size_t leaked = 0;
+            bool claimed = owner == 0 && header->subscribers[i].compare_exchange_strong(owner, pid);
+            if (!claimed && owner != 0 && owner != details::reclaiming && pool.reclaim(i, owner, leaked)) {
+                header->subscribers[i].store(pid);
+                claimed = true;
+            }
+
+            if (claimed) {
+                header->created_at[i].store(created_at);
+                pool.m_param->subscriber = i;
+                return pool;
+            }
+        }
+
+        throw std::runtime_error("Too many subscribers.");
+    }
+
+    payload_pool(payload_pool&&) noexcept = default;
+
+    ~payload_pool()
+    {
+        unsubscribe();
+    }
+
+    payload_pool& operator=(payload_pool&& other) noexcept
+    {
+        if (this != &other) {
+            unsubscribe();
+            m_param = std::move(other.m_param);
+        }
+        return *this;
+    }
+
+    /// <summary>
+    /// Takes a block off the free list for the publisher to write into. If
+    /// there are none left, cleans up after crashed subscribers and tries
+    /// again. Returns nullptr if still nothing is free.
+    /// </summary>
+    uint8_t* allocate()
+    {
+        if (!m_param)
+            return nullptr;
+
+        uint32_t index = details::free_list_pop(m_param->header->free_head, m_param->meta);
+        if (index == npos && reclaim() > 0)
+            index = details::free_list_pop(m_param->header->free_head, m_param->meta);
+
+        return block(index);
+    }
+
+    /// <summary>
+    /// Hands a block written by the publisher to every current subscriber, and
+    /// returns the index to send them. If there are no subscribers, the block
+    /// is freed straight away and npos is returned.
+    /// </summary>
+    uint32_t share(uint8_t* block, size_t size)
+    {
+        uint32_t index = index_of(block);
+        if (index == npos)
+            return npos;
+
+        DWORD owners[details::max_subscribers];
+        uint64_t holders = 0;
+        for (size_t i = 0; i < details::max_subscribers; i++) {
+            owners[i] = m_param->header->subscribers[i].load(std::memory_order_relaxed);
+            if (owners[i] != 0 && owners[i] != details::reclaiming)
+                holders |= (uint64_t)1 << i;
+        }
+
+        auto& meta = m_param->meta[index];
+        meta.size = (uint32_t)std::min<size_t>(size, m_param->header->block_size);
+        if (holders == 0) {
+            details::free_list_push(m_param->header->free_head, index, m_param->meta);
+            return npos;
+        }
+
+        meta.holders.store(holders);
+
+        // A subscriber that left between the snapshot and the store may
+        // already have released everything it held, this block included, and
+        // nobody would ever clear its bit. Either it sees the bit, or we see
+        // it gone; drop the bits of those that left.
+        for (size_t i = 0; i < details::max_subscribers; i++) {
+            if ((holders & ((uint64_t)1 << i)) && m_param->header->subscribers[i].load() != owners[i])
+                drop(index, i);
+        }
+
+        if (meta.holders.load(std::memory_order_acquire) == 0)
+            return npos;
+        return index;
+    }
+
+    /// <summary>
+    /// For subscribers. Looks up a shared block by index. Returns nullptr for
+    /// an invalid index.
+    /// </summary>
+    const uint8_t* data(uint32_t index) const
+    {
+        return block(index);
+    }
+
+    size_t size(uint32_t index) const
+    {
+        if (!m_param || index >= m_param->header->block_count)
+            return 0;
+
+        return m_param->meta[index].size;
+    }
+
+    /// <summary>
+    /// Number of subscribers still holding on to a block.
+    /// </summary>
+    size_t refs(uint32_t index) const
+    {
+        if (!m_param || index >= m_param->header->block_count)
+            return 0;
+
+        uint64_t holders = m_param->meta[index].holders.load(std::memory_order_relaxed);
+        size_t count = 0;
+        for (; holders != 0; holders &= holders - 1)
+            count++;
+        return count;
+    }
+
+    /// <summary>
+    /// For subscribers. Done with a block; it's freed if this was the last
+    /// subscriber holding it.
+    /// </summary>
+    void release(uint32_t index)
+    {
+        if (!m_param || m_param->subscriber == npos || index >= m_param->header->block_count)
+            return;
+
+        drop(index, m_param->subscriber);
+    }
+
+    /// <summary>
+    /// Releases every block still held by subscribers that have exited
+    /// without releasing them. Returns how many such leaked references were
+    /// found.
+    /// </summary>
+    size_t reclaim()
+    {
+        if (!m_param)
+            return 0;
+
+        size_t leaked = 0;
+        for (size_t i = 0; i < details::max_subscribers; i++) {
+            DWORD owner = m_param->header->subscribers[i].load();
+            if (owner == 0 || owner == details::reclaiming)
+                continue;
+
+            if (reclaim(i, owner, leaked))
+                m_param->header->subscribers[i].store(0);
+        }
+        return leaked;
+    }
+
+private:
+    /// <summary>
+    /// Lets go of everything still held, so that leaving doesn't leak.
+    /// </summary>
+    void unsubscribe()
+    {
+        if (!m_param || m_param->subscriber == npos)
+            return;
+
+        size_t subscriber = m_param->subscriber;
+        m_param->header->subscribers[subscriber].store(details::reclaiming);
+        m_param->header->created_at[subscriber].store(0);
+        release_all(subscriber);
+        m_param->header->subscribers[subscriber].store(0);
+    }
+
+    /// <summary>
+    /// If the subscriber in the given slot has exited, claims the slot and
+    /// releases everything it held. Returns whether it did, in which case the
+    /// caller owns the slot (still marked as reclaiming).
+    /// </summary>
+    bool reclaim(size_t subscriber, DWORD owner, size_t& leaked)
+    {
+        uint64_t created_at = m_param->header->created_at[subscriber].load();
+        if (!details::process_exited(owner, created_at))
+            return false;
+
+        // The slot may have changed hands since owner was read, in which
+        // case created_at may belong to the new owner. Then this fails.
+        if (!m_param->header->subscribers[subscriber].compare_exchange_strong(owner, details::reclaiming))
+            return false;
+
+        m_param->header->created_at[subscriber].store(0);
+        leaked += release_all(subscriber);
+        return true;
+    }
+
+    size_t release_all(size_t subscriber)
+    {
+        size_t released = 0;
+        for (uint32_t i = 0; i < m_param->header->block_count; i++)
+            released += drop(i, subscriber);
+        return released;
+    }
+
+    /// <summary>
+    /// Clears the subscriber's bit on a block, freeing the block if it was
+    /// the last. Returns whether the bit was set.
+    /// </summary>
+    bool drop(uint32_t index, size_t subscriber)
+    {
+        uint64_t bit = (uint64_t)1 << subscriber;
+        uint64_t holders = m_param->meta[index].holders.fetch_and(~bit, std::memory_order_acq_rel);
+        if (!(holders & bit))
+            return false;
+
+        if (holders == bit)
+            details::free_list_push(m_param->header->free_head, index, m_param->meta);
+        return true;
+    }
+
+    uint8_t* block(uint32_t index) const
+    {
+        if (!m_param || index >= m_param->header->block_count)
+            return nullptr;
+
+        return m_param->blocks + (size_t)index * m_param->header->block_size;
+    }
+
+    uint32_t index_of(const uint8_t* block) const
+    {
+        if (!m_param || block < m_param->blocks)
+            return npos;
+
+        size_t index = (size_t)(block - m_param->blocks) / m_param->header->block_size;
+        if (index >= m_param->header->block_count)
+            return npos;
+
+        return (uint32_t)index;
+    }
+
+    void map(std::string_view name, size_t size, bool create)
+    {
+        m_param = std::make_unique<param>();
+        m_param->view = details::map_shared_memory(details::format_object_name("payloads", name),
+            size, create, m_param->mapping);
+        m_param->header = reinterpret_cast<details::payload_pool_header*>(m_param->view.get());
+    }
+
+    void locate()
+    {
+        auto* base = reinterpret_cast<uint8_t*>(m_param->view.get());
+        m_param->meta = reinterpret_cast<details::payload_block*>(base + sizeof(details::payload_pool_header));
+        m_param->blocks = base + details::payload_blocks_offset(m_param->header->block_count);
+    }
+
+private:
+    struct param {
+        details::unique_handle mapping;
+        details::unique_view view;
+        details::payload_pool_header* header = nullptr;
+        details::payload_block* meta = nullptr;
+        uint8_t* blocks = nullptr;
+        size_t subscriber = npos;
+    };
+
+private:
+    std::unique_ptr<param> m_param;
+};
+
+// ---------------------------------------------------------------[ shared_arena
+
+/// <summary>
+/// Pointer that stays valid when the memory it lives in is mapped at a
+/// different address, e.g. in another process, by storing the distance from
+/// itself to its target instead of an address. Both have to be in the same
+/// shared memory for that to work.
+/// <para/>
+/// Note: copying an offset_ptr recalculates the distance, so it has to be
+/// copied with its copy constructor/assignment, never with memcpy.
+/// </summary>
+template <class T>
+class offset_ptr {
+public:
+    offset_ptr() = default;
+
+    offset_ptr(T* ptr)
+    {
+        set(ptr);
+    }
+
+    offset_ptr(const offset_ptr& other)
+    {
+        set(other.get());
+    }
+
+    offset_ptr& operator=(const offset_ptr& other)
+    {
+        set(other.get());
+        return *this;
+    }
+
+    offset_ptr& operator=(T* ptr)
+    {
+        set(ptr);
+        return *this;
+    }
+
+    T* get() const
+    {
+        if (m_offset == 0)
+            return nullptr;
+
+        return reinterpret_cast<T*>(reinterpret_cast<intptr_t>(this) + m_offset);
+    }
+
+    T* operator->() const
+    {
+        return get();
+    }
+
+    T& operator*() const
+    {
+        return *get();
+    }
+
+    T& operator[](size_t index) const
+    {
+        return get()[index];
+    }
+
+    explicit operator bool() const
+    {
+        return m_offset != 0;
+    }
+
+private:
+    // Zero means null. Nothing ever points at itself, so it can't clash with
+    // a real target.
+    void set(T* ptr)
+    {
+        m_offset = ptr ? reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this) : 0;
+    }
+
+private:
+    int64_t m_offset = 0;
+};
+
+namespace details {
+    struct arena_header {
+        uint64_t capacity;
+        std::atomic<uint64_t> used;
+    };
+
+    /// <summary>
+    /// Bump-allocates from the arena. Works from any process that has the
+    /// arena mapped, since everything is relative to the header. Returns
+    /// nullptr when full.
+    /// </summary>
+    static inline void* arena_allocate(arena_header* header, size_t size, size_t alignment)
+    {
+        uint64_t used = header->used.load(std::memory_order_relaxed);
+        uint64_t begin;
+        do {
+            begin = (used + alignment - 1) & ~(uint64_t)(alignment - 1);
+            if (begin + size > header->capacity)
+                return nullptr;
+        } while (!header->used.compare_exchange_weak(used, begin + size,
+            std::memory_order_relaxed));
+
+        return reinterpret_cast<uint8_t*>(header) + begin;
+    }
+
+    template <class T>
+    static inline T* arena_allocate(arena_header* header, size_t count)
+    {
+        void* memory = arena_allocate(header, sizeof(T) * count, alignof(T));
+        if (!memory)
+            throw std::bad_alloc();
+
+        return reinterpret_cast<T*>(memory);
+    }
+}
+
+/// <summary>
+/// A named chunk of shared memory to build data structures in, so that
+/// another process can use them directly instead of receiving them
+/// serialized. Build with the shared_* containers (or anything else made of
+/// offset_ptrs), then send offset_of() the root; the other process opens the
+/// same arena and finds the root with at().
+/// <para/>
+/// Allocation is a lock-free bump of a counter, and nothing is ever freed
+/// until the arena itself goes away.
+/// </summary>
+class shared_arena {
+public:
+    /// <summary>
+    /// Default constructor. Does nothing. Can't allocate anything.
+    /// <para/>
+    /// Note: remember that move constructor exists. This constructor is mainly
+    /// meant for use with containers which require a default constructor.
+    /// </summary>
+    shared_arena() = default;
+
+    /// <summary>
+    /// Creates an arena of the given size in bytes. Throws if it can't be
+    /// created, or already exists.
+    /// </summary>
+    static shared_arena create(std::string_view name, size_t size)
+    {
+        shared_arena arena;
+        arena.map(name, size, true);
+
+        auto* header = new (arena.m_param->view.get()) details::arena_header {};
+        header->capacity = size;
+        header->used.store(sizeof(details::arena_header));
+        return arena;
+    }
+
+    /// <summary>
+    /// Opens an arena created by another process. Throws if it doesn't exist.
+    /// </summary>
+    static shared_arena open(std::string_view name)
+    {
+        shared_arena arena;
+        arena.map(name, 0, false);
+        return arena;
+    }
+
+    /// <summary>
+    /// Returns nullptr when the arena is full.
+    /// </summary>
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        if (!m_param)
+            return nullptr;
+
+        return details::arena_allocate(header(), size, alignment);
+    }
+
+    /// <summary>
+    /// Allocates and constructs a T. Throws std::bad_alloc when the arena is
+    /// full. The shared_* containers take the arena as their first argument.
+    /// </summary>
+    template <class T, class... Args>
+    T* construct(Args&&... args)
+    {
+        void* memory = allocate(sizeof(T), alignof(T));
+        if (!memory)
+            throw std::bad_alloc();
+
+        return new (memory) T(std::forward<Args>(args)...);
+    }
+
+    /// <summary>
+    /// Where something in the arena is, in a form that means the same thing in
+    /// every process.
+    /// </summary>
+    uint64_t offset_of(const void* ptr) const
+    {
+        return (uint64_t)(reinterpret_cast<const uint8_t*>(ptr)
+            - reinterpret_cast<const uint8_t*>(m_param->view.get()));
+    }
+
+    template <class T>
+    T* at(uint64_t offset) const
+    {
+        if (!m_param || offset >= header()->capacity)
+            return nullptr;
+
+        return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(m_param->view.get()) + offset);
+    }
+
+    details::arena_header* header() const
+    {
+        return m_param ? reinterpret_cast<details::arena_header*>(m_param->view.get()) : nullptr;
+    }
+
+    size_t used() const
+    {
+        return m_param ? (size_t)header()->used.load(std::memory_order_relaxed) : 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_param ? (size_t)header()->capacity : 0;
+    }
+
+private:
+    void map(std::string_view name, size_t size, bool create)
+    {
+        m_param = std::make_unique<param>();
+        m_param->view = details::map_shared_memory(details::format_object_name("arena", name),
+            size, create, m_param->mapping);
+    }
+
+private:
+    struct param {
+        details::unique_handle mapping;
+        details::unique_view view;
+    };
+
+private:
+    std::unique_ptr<param> m_param;
+};
+
+/// <summary>
+/// Immutable string in a shared_arena.
+/// </summary>
+class shared_string {
+public:
+    shared_string() = default;
+
+    shared_string(shared_arena& arena, std::string_view value)
+    {
+        char* data = details::arena_allocate<char>(arena.header(), value.size() + 1);
+        std::memcpy(data, value.data(), value.size());
+        data[value.size()] = '\0';
+
+        m_data = data;
+        m_size = value.size();
+    }
+
+    std::string_view view() const
+    {
+        return m_data ? std::string_view { m_data.get(), (size_t)m_size } : std::string_view {};
+    }
+
+    const char* c_str() const
+    {
+        return m_data ? m_data.get() : "";
+    }
+
+    size_t size() const
+    {
+        return (size_t)m_size;
+    }
+
+private:
+    offset_ptr<char> m_data;
+    uint64_t m_size = 0;
+};
+
+/// <summary>
+/// Growable array in a shared_arena. Elements have to be copyable, and only
+/// ever get copied with their copy constructor, so they can contain
+/// offset_ptrs (e.g. shared_string). Storage left behind by growing isn't
+/// reclaimed, so reserve() up front when the size is known.
+/// </summary>
+template <class T>
+class shared_vector {
+public:
+    explicit shared_vector(shared_arena& arena)
+        : m_arena { arena.header() }
+    {
+    }
+
+    shared_vector(const shared_vector&) = delete;
+    shared_vector& operator=(const shared_vector&) = delete;
+
+    size_t size() const
+    {
+        return (size_t)m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    T* data() const
+    {
+        return m_data.get();
+    }
+
+    T& operator[](size_t index) const
+    {
+        return m_data[index];
+    }
+
+    T* begin() const
+    {
+        return data();
+    }
+
+    T* end() const
+    {
+        return data() + m_size;
+    }
+
+    void reserve(size_t capacity)
+    {
+        if (capacity <= m_capacity)
+            return;
+
+        T* data = details::arena_allocate<T>(m_arena.get(), capacity);
+        for (size_t i = 0; i < m_size; i++)
+            new (data + i) T(m_data[i]);
+
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+    void push_back(const T& value)
+    {
+        if (m_size == m_capacity)
+            reserve(m_capacity == 0 ? 8 : (size_t)m_capacity * 2);
+
+        new (m_data.get() + m_size) T(value);
+        m_size++;
+    }
+
+private:
+    offset_ptr<details::arena_header> m_arena;
+    offset_ptr<T> m_data;
+    uint64_t m_size = 0;
+    uint64_t m_capacity = 0;
+};
+
+namespace details {
+    static inline uint64_t fnv1a(const void* data, size_t size)
+    {
+        auto* bytes = reinterpret_cast<const uint8_t*>(data);
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Keys are compared and hashed through these, so that a map keyed by
+    // shared_string can be searched with a plain std::string_view. Hashes have
+    // to come out the same in every process, so std::hash is out.
+    template <class T>
+    static inline const T& key_view(const T& key)
+    {
+        return key;
+    }
+
+    static inline std::string_view key_view(const shared_string& key)
+    {
+        return key.view();
+    }
+
+    template <class T>
+    static inline uint64_t hash_key(const T& key)
+    {
+        if constexpr (std::is_same_v<T, std::string_view>) {
+            return fnv1a(key.data(), key.size());
+        } else {
+            static_assert(std::is_integral_v<T> || std::is_enum_v<T>,
+                "shared_hash_map keys must be integers, enums or shared_strings.");
+            return fnv1a(&key, sizeof(key));
+        }
+    }
+}
+
+/// <summary>
+/// Open-addressing hash map in a shared_arena. Keys can be integers, enums
+/// or shared_strings; maps keyed by shared_string can be searched with a
+/// std::string_view. Values have the same requirements as shared_vector
+/// elements, plus being default constructible. Entries can't be removed.
+/// </summary>
+template <class Key, class Value>
+class shared_hash_map {
+public:
+    explicit shared_hash_map(shared_arena& arena, size_t capacity = 16)
+        : m_arena { arena.header() }
+    {
+        size_t power = 16;
+        while (power < capacity)
+            power *= 2;
+        rehash(power);
+    }
+
+    shared_hash_map(const shared_hash_map&) = delete;
+    shared_hash_map& operator=(const shared_hash_map&) = delete;
+
+    size_t size() const
+    {
+        return (size_t)m_size;
+    }
+
+    /// <summary>
+    /// Returns nullptr if the key isn't there.
+    /// </summary>
+    template <class K>
+    Value* find(const K& key) const
+    {
+        // Other key types are converted first, since integers are hashed by
+        // their bytes: find(5) has to hash the same as a uint64_t key of 5.
+        if constexpr (std::is_same_v<Key, shared_string>) {
+            return lookup(std::string_view(details::key_view(key)));
+        } else {
+            const Key& k = key;
+            return lookup(k);
+        }
+    }
+
+    /// <summary>
+    /// Inserts or overwrites. Throws std::bad_alloc if the arena is full.
+    /// </summary>
+    Value& insert(const Key& key, const Value& value)
+    {
+        if (Value* existing = find(key)) {
+            *existing = value;
+            return *existing;
+        }
+
+        // Grow at 70% full, to keep probe sequences short.
+        if ((m_size + 1) * 10 > m_capacity * 7)
+            rehash((size_t)m_capacity * 2);
+
+        slot& s = place(key);
+        s.value = value;
+        m_size++;
+        return s.value;
+    }
+
+    template <class F>
+    void for_each(F&& f) const
+    {
+        for (uint64_t i = 0; i < m_capacity; i++) {
+            if (m_slots[i].used)
+                f(m_slots[i].key, m_slots[i].value);
+        }
+    }
+
+private:
+    struct slot {
+        bool used = false;
+        Key key {};
+        Value value {};
+    };
+
+    template <class K>
+    Value* lookup(const K& k) const
+    {
+        uint64_t mask = m_capacity - 1;
+        for (uint64_t i = details::hash_key(k) & mask;; i = (i + 1) & mask) {
+            slot& s = m_slots[i];
+            if (!s.used)
+                return nullptr;
+            if (details::key_view(s.key) == k)
+                return &s.value;
+        }
+    }
+
+    slot& place(const Key& key)
+    {
+        uint64_t mask = m_capacity - 1;
+        uint64_t i = details::hash_key(details::key_view(key)) & mask;
+        while (m_slots[i].used)
+            i = (i + 1) & mask;
+
+        slot& s = m_slots[i];
+        s.used = true;
+        s.key = key;
+        return s;
+    }
+
+    void rehash(size_t capacity)
+    {
+        slot* slots = details::arena_allocate<slot>(m_arena.get(), capacity);
+        for (size_t i = 0; i < capacity; i++)
+            new (slots + i) slot {};
+
+        offset_ptr<slot> old_slots = m_slots;
+        uint64_t old_capacity = m_capacity;
+        m_slots = slots;
+        m_capacity = capacity;
+
+        for (uint64_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i].used)
+                place(old_slots[i].key).value = old_slots[i].value;
+        }
     }
 
 private:
-    details::unique_handle m_pipe;
-    std::string m_name;
+    offset_ptr<details::arena_header> m_arena;
+    offset_ptr<slot> m_slots;
+    uint64_t m_size = 0;
+    uint64_t m_capacity = 0;
 };
 
 }